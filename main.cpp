@@ -8,9 +8,27 @@
 #include <stdexcept>
 #include <functional>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <charconv>
+#include <thread>
+#include <unordered_map>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <ucontext.h>
+#include <deque>
+#include <queue>
+#include <chrono>
 #include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
 
-bool g_keep_running = true;
+volatile std::sig_atomic_t g_keep_running = true;
 
 void sig_handler(int s) {
   if (s == SIGINT) {
@@ -19,11 +37,95 @@ void sig_handler(int s) {
   }
 }
 
+// ---- evaluation budgets ----
+//
+// Every function call made by the evaluator burns one unit of fuel. The
+// clock (and SIGINT) is only looked at every EVAL_CLOCK_CHECK_INTERVAL
+// steps to keep the check cheap.
+
+constexpr uint32_t EVAL_CLOCK_CHECK_INTERVAL = 1024;
+// longer deadlines are clamped to this, way past any sane evaluation but
+// far from overflowing the clock
+constexpr std::chrono::milliseconds EVAL_MAX_DURATION = std::chrono::hours(24 * 365 * 100);
+
+struct EvalLimitExceeded : public std::runtime_error {
+  explicit EvalLimitExceeded(const char *what)
+    : std::runtime_error(what) {}
+};
+
+struct EvalBudget {
+  uint64_t fuel = std::numeric_limits<uint64_t>::max();
+  bool has_deadline = false;
+  std::chrono::steady_clock::time_point deadline;
+  uint32_t until_clock_check = EVAL_CLOCK_CHECK_INTERVAL;
+};
+
+EvalBudget g_eval_budget;
+
+// limits applied to every top level evaluation, see set-limits
+EvalBudget g_eval_limits;
+
+// g_eval_budget is a working copy of this budget, which tasks spawned by
+// the current evaluation draw from as well
+std::shared_ptr<EvalBudget> g_eval_budget_shared = std::make_shared<EvalBudget>();
+
+void eval_budget_save()
+{
+  *g_eval_budget_shared = g_eval_budget;
+}
+
+void eval_budget_load(const std::shared_ptr<EvalBudget> &budget)
+{
+  g_eval_budget_shared = budget;
+  g_eval_budget = *budget;
+}
+
+void eval_check_clock()
+{
+  g_eval_budget.until_clock_check = EVAL_CLOCK_CHECK_INTERVAL;
+  if (!g_keep_running) {
+    throw std::runtime_error("interrupted");
+  }
+  if (g_eval_budget.has_deadline && std::chrono::steady_clock::now() >= g_eval_budget.deadline) {
+    throw EvalLimitExceeded("deadline exceeded");
+  }
+}
+
+inline void eval_step()
+{
+  if (g_eval_budget.fuel == 0) {
+    throw EvalLimitExceeded("out of fuel");
+  }
+  --g_eval_budget.fuel;
+  if (--g_eval_budget.until_clock_check == 0) {
+    eval_check_clock();
+  }
+}
+
+// charges several steps at once, for code that applies functions without
+// going through eval
+inline void eval_charge(uint64_t steps)
+{
+  if (g_eval_budget.fuel < steps) {
+    g_eval_budget.fuel = 0;
+    throw EvalLimitExceeded("out of fuel");
+  }
+  g_eval_budget.fuel -= steps;
+  if (g_eval_budget.until_clock_check <= steps) {
+    eval_check_clock();
+  } else {
+    g_eval_budget.until_clock_check -= static_cast<uint32_t>(steps);
+  }
+}
+
 // #define DEBUG_TRACE;
+#define ENABLE_JIT
 
 typedef double symbol_number_type;
 
 struct ConsCell;
+struct LazySeq;
+struct Channel;
 struct LispType {
   enum Type {
     nil,
@@ -31,7 +133,9 @@ struct LispType {
     variable,
     number,
     cons,
-    function
+    function,
+    sequence,
+    channel
   };
 
   Type type = Type::nil;
@@ -39,10 +143,12 @@ struct LispType {
   symbol_number_type number_val = 0.0;
   std::string string_val;
   std::shared_ptr<ConsCell> cons_val;
+  std::shared_ptr<const LazySeq> seq_val;
+  std::shared_ptr<Channel> chan_val;
 };
 
-void print_cons_recursive(const LispType &cons, int depth, std::ostream &o);
-void print_lisp_type(const LispType &sym, bool with_type, std::ostream &o);
+void append_lisp_type(const LispType &sym, bool with_type, std::string &out);
+void print_lisp_type(const LispType &sym, bool with_type, std::ostream &o = std::cout);
 
 std::ostream& operator << (std::ostream& o, const LispType& a)
 {
@@ -66,37 +172,12 @@ LispType make_nil()
   };
 }
 
-void print_lisp_type(const LispType &sym, bool with_type, std::ostream& o = std::cout)
+LispType make_symbol(const std::string &name)
 {
-  switch (sym.type) {
-  case LispType::Type::nil:
-    o << "nil";
-    break;
-  case LispType::Type::number:
-    o << (with_type ? "[n] " : "") << sym.number_val;
-    break;
-  case LispType::Type::variable:
-    o << (with_type ? "[v] " : "") << sym.string_val;
-    break;
-  case LispType::Type::symbol:
-    o << (with_type ? "[s] " : "") << "'" << sym.string_val;
-    break;
-  case LispType::Type::function:
-    o << (with_type ? "[f] " : "") << sym.string_val;
-    break;
-  case LispType::Type::cons:
-    if (with_type) {
-      o << "[c] ";
-    }
-    print_cons_recursive(sym, 0, o);
-    break;
-  default:
-    std::stringstream ss;
-    ss << "cant print type: ";
-    ss << sym.type;
-    throw std::runtime_error(ss.str());
-    break;
-  }
+  return {
+    .type = LispType::Type::symbol,
+    .string_val = name
+  };
 }
 
 void eval(const LispType& code, LispType &result);
@@ -118,6 +199,18 @@ struct ConsCell {
     : head(std::move(_h)), tail(_t) {}
 
   ~ConsCell() {
+    // unlink everything nobody else can reach onto a worklist first,
+    // otherwise dropping a long or deeply nested list recurses once per
+    // cell through the shared_ptr destructors
+    std::vector<std::shared_ptr<ConsCell>> pending;
+    release_children(pending);
+    while (!pending.empty()) {
+      std::shared_ptr<ConsCell> cell = std::move(pending.back());
+      pending.pop_back();
+      if (cell.use_count() == 1) {
+        cell->release_children(pending);
+      }
+    }
     head = make_nil();
     tail = nullptr;
 #ifdef DEBUG_TRACE
@@ -125,6 +218,19 @@ struct ConsCell {
 #endif
   }
   
+  // hands out the nested cell in head and the next cell of the list, the
+  // latter only if nobody else can reach the tail
+  void release_children(std::vector<std::shared_ptr<ConsCell>> &out)
+  {
+    if (head.type == LispType::Type::cons && head.cons_val != nullptr) {
+      out.push_back(std::move(head.cons_val));
+    }
+    if (tail != nullptr && tail.use_count() == 1 &&
+        tail->head.type == LispType::Type::cons && tail->head.cons_val != nullptr) {
+      out.push_back(std::move(tail->head.cons_val));
+    }
+  }
+
   ConsCell(const ConsCell &other) = default;
   ConsCell(ConsCell &&other) = default;
 
@@ -132,27 +238,127 @@ struct ConsCell {
   ConsCell& operator=(ConsCell&& other) = default;
 };
 
-void print_cons_recursive(const LispType &cons, int depth, std::ostream &o)
+// Numbers are written in the shortest form that reads back to the same
+// double, except that exactly representable integers are always written
+// out in full (400000 rather than 4e+05).
+constexpr symbol_number_type MAX_EXACT_INTEGER = 9007199254740992.0; // 2^53
+
+void append_number(symbol_number_type number, std::string &out)
 {
-  if (depth == 0) {
-    o << "(";
+  char buffer[32];
+  std::to_chars_result res;
+  if (std::fabs(number) < MAX_EXACT_INTEGER && number == std::trunc(number)) {
+    res = std::to_chars(buffer, buffer + sizeof(buffer), number, std::chars_format::fixed);
+  } else {
+    res = std::to_chars(buffer, buffer + sizeof(buffer), number);
   }
-  //  std::cout << "type: " << cons.type << "\n";
-  if (cons.type == LispType::Type::cons) {
-    print_lisp_type(cons.cons_val->head, false);
-    if (cons.cons_val->tail != nullptr &&
-        cons.cons_val->tail->head.type != LispType::Type::nil) {
-      o << " ";
-      print_cons_recursive(cons.cons_val->tail->head, depth + 1, o);
+  out.append(buffer, res.ptr);
+}
+
+void append_atom(const LispType &sym, bool with_type, std::string &out)
+{
+  switch (sym.type) {
+  case LispType::Type::nil:
+    out += "nil";
+    break;
+  case LispType::Type::number:
+    if (with_type) {
+      out += "[n] ";
     }
-  } else {
-    print_lisp_type(cons, false, o);
+    append_number(sym.number_val, out);
+    break;
+  case LispType::Type::variable:
+    if (with_type) {
+      out += "[v] ";
+    }
+    out += sym.string_val;
+    break;
+  case LispType::Type::symbol:
+    if (with_type) {
+      out += "[s] ";
+    }
+    out += '\'';
+    out += sym.string_val;
+    break;
+  case LispType::Type::function:
+    if (with_type) {
+      out += "[f] ";
+    }
+    out += sym.string_val;
+    break;
+  case LispType::Type::sequence:
+    out += with_type ? "[q] #<seq>" : "#<seq>";
+    break;
+  case LispType::Type::channel:
+    out += with_type ? "[h] #<chan>" : "#<chan>";
+    break;
+  default:
+    std::stringstream ss;
+    ss << "cant print type: ";
+    ss << sym.type;
+    throw std::runtime_error(ss.str());
+    break;
+  }
+}
+
+// Appends to out without recursing, nested lists are tracked on an
+// explicit stack of positions. A tail that is not a cons cell gets
+// printed as the last element, like nth sees it.
+void append_lisp_type(const LispType &sym, bool with_type, std::string &out)
+{
+  if (sym.type != LispType::Type::cons) {
+    append_atom(sym, with_type, out);
+    return;
   }
-  if (depth == 0) {
-    o << ")";
+  if (with_type) {
+    out += "[c] ";
+  }
+
+  struct Position {
+    const LispType *rest;
+    bool first;
+  };
+  std::vector<Position> stack = { { &sym, true } };
+  out += '(';
+
+  while (!stack.empty()) {
+    Position &pos = stack.back();
+    if (pos.rest == nullptr) {
+      out += ')';
+      stack.pop_back();
+      continue;
+    }
+    if (!pos.first) {
+      out += ' ';
+    }
+    pos.first = false;
+
+    const LispType *elem = pos.rest;
+    pos.rest = nullptr;
+    if (elem->type == LispType::Type::cons) {
+      const ConsCell *cell = elem->cons_val.get();
+      elem = &cell->head;
+      if (cell->tail != nullptr && cell->tail->head.type != LispType::Type::nil) {
+        pos.rest = &cell->tail->head;
+      }
+    }
+
+    if (elem->type == LispType::Type::cons) {
+      out += '(';
+      stack.push_back({ elem, true });
+    } else {
+      append_atom(*elem, false, out);
+    }
   }
 }
 
+void print_lisp_type(const LispType &sym, bool with_type, std::ostream &o)
+{
+  std::string out;
+  append_lisp_type(sym, with_type, out);
+  o.write(out.data(), static_cast<std::streamsize>(out.size()));
+}
+
 void cons(const LispType &a, const LispType &b, LispType &result)
 {
   auto new_cons = std::make_shared<ConsCell>(a, std::make_shared<ConsCell>(b));
@@ -163,6 +369,103 @@ void cons(const LispType &a, const LispType &b, LispType &result)
   };
 }
 
+// ---- hash-consing ----
+//
+// When enabled the reader builds its structure through hash_cons, which
+// returns the existing cell for a (head, tail) pair that is already alive.
+// Structurally equal subtrees then share one node and equal? on them is a
+// pointer compare. Such cells must never be mutated. The table only holds
+// weak references and expired entries get swept as it grows.
+
+constexpr size_t HASH_CONS_SWEEP_SIZE = 4096;
+
+bool g_hash_consing = false;
+std::unordered_multimap<size_t, std::weak_ptr<ConsCell>> g_hash_cons_table;
+size_t g_hash_cons_next_sweep = HASH_CONS_SWEEP_SIZE;
+
+size_t hash_combine(size_t seed, size_t value)
+{
+  return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+uint64_t number_bits(symbol_number_type number)
+{
+  uint64_t bits;
+  std::memcpy(&bits, &number, sizeof(bits));
+  return bits;
+}
+
+// children are interned too, so they compare by identity
+bool same_head(const LispType &a, const LispType &b)
+{
+  return a.type == b.type
+    && number_bits(a.number_val) == number_bits(b.number_val)
+    && a.string_val == b.string_val
+    && a.cons_val == b.cons_val
+    && a.seq_val == b.seq_val
+    && a.chan_val == b.chan_val;
+}
+
+size_t hash_cell(const LispType &head, const ConsCell *tail)
+{
+  size_t h = std::hash<int>()(head.type);
+  h = hash_combine(h, std::hash<uint64_t>()(number_bits(head.number_val)));
+  h = hash_combine(h, std::hash<std::string>()(head.string_val));
+  h = hash_combine(h, std::hash<const void*>()(head.cons_val.get()));
+  h = hash_combine(h, std::hash<const void*>()(head.seq_val.get()));
+  h = hash_combine(h, std::hash<const void*>()(head.chan_val.get()));
+  return hash_combine(h, std::hash<const void*>()(tail));
+}
+
+void hash_cons_sweep()
+{
+  for (auto it = g_hash_cons_table.begin(); it != g_hash_cons_table.end();) {
+    if (it->second.expired()) {
+      it = g_hash_cons_table.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  g_hash_cons_next_sweep = std::max(HASH_CONS_SWEEP_SIZE, g_hash_cons_table.size() * 2);
+}
+
+std::shared_ptr<ConsCell> intern_cell(const LispType &head, const std::shared_ptr<ConsCell> &tail)
+{
+  size_t h = hash_cell(head, tail.get());
+  auto range = g_hash_cons_table.equal_range(h);
+  for (auto it = range.first; it != range.second; ++it) {
+    std::shared_ptr<ConsCell> cell = it->second.lock();
+    if (cell != nullptr && cell->tail == tail && same_head(cell->head, head)) {
+      return cell;
+    }
+  }
+
+  if (g_hash_cons_table.size() >= g_hash_cons_next_sweep) {
+    hash_cons_sweep();
+  }
+  auto cell = std::make_shared<ConsCell>(head, tail);
+  g_hash_cons_table.emplace(h, cell);
+  return cell;
+}
+
+void hash_cons(const LispType &a, const LispType &b, LispType &result)
+{
+  auto tail = intern_cell(b, nullptr);
+  result = {
+    .type = LispType::Type::cons,
+    .cons_val = intern_cell(a, tail)
+  };
+}
+
+void reader_cons(const LispType &a, const LispType &b, LispType &result)
+{
+  if (g_hash_consing) {
+    hash_cons(a, b, result);
+  } else {
+    cons(a, b, result);
+  }
+}
+
 void car(const LispType &a, LispType &result)
 {
   // std::cout << "CAR: ";
@@ -215,38 +518,40 @@ void make_list(const std::vector<LispType> &args, LispType &result)
   }
 }
 
-void iter_cons(const LispType &cons, int target_idx, int idx, LispType &result)
+void iter_cons(const LispType &cons, uint64_t target_idx, uint64_t idx, LispType &result)
 {
-  if (idx == target_idx) {
-    if (cons.type == LispType::Type::cons) {
-      car(cons, result);
-    } else {
-      result = cons;
+  const LispType *current = &cons;
+  for (; idx < target_idx; ++idx) {
+    if (current->type != LispType::Type::cons || current->cons_val->tail == nullptr) {
+      result = make_nil();
+      return;
     }
-    return;
+    current = &current->cons_val->tail->head;
   }
 
-  if (cons.type == LispType::Type::cons) {
-    LispType tail;
-    cdr(cons, tail);
-    iter_cons(tail, target_idx, idx + 1, result);
+  if (current->type == LispType::Type::cons) {
+    car(*current, result);
   } else {
-    result = make_nil();
+    result = *current;
   }
 }
 
+void nth_seq(const LispType &seq_type, uint64_t index, LispType &result);
+uint64_t seq_count_arg(const LispType &val, const char *fn_name);
+
 void nth(const LispType &idx_type, const LispType &cons_type, LispType &result)
 {
   if (idx_type.type != LispType::Type::number) {
     throw std::runtime_error("nth arg0 must be number");
   }
+  uint64_t index = seq_count_arg(idx_type, "nth");
+  if (cons_type.type == LispType::Type::sequence) {
+    nth_seq(cons_type, index, result);
+    return;
+  }
   if (cons_type.type != LispType::Type::cons) {
     throw std::runtime_error("nth arg1 must be cons cell");
   }
-  int index = static_cast<int>(idx_type.number_val);
-  if (index < 0) {
-    throw std::runtime_error("nth arg0 must be positive number");
-  }
 
   iter_cons(cons_type, index, 0, result);
 }
@@ -257,12 +562,15 @@ std::map<std::string, std::function<void(std::vector<LispType>&, LispType&)>> g_
 
 void builtin_dump_variables(const std::vector<LispType> &args, LispType &result_sym)
 {
+  std::string out;
   for (auto it = g_variables.begin(); it != g_variables.end(); ++it) {
     const LispType &type = it->second;
-    std::cout << it->first << "\t\t\t\t";
-    print_lisp_type(type, true);
-    std::cout << "\n";
+    out += it->first;
+    out += "\t\t\t\t";
+    append_lisp_type(type, true, out);
+    out += '\n';
   }
+  std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
   result_sym = { .type = LispType::Type::nil };
 }
 
@@ -302,6 +610,18 @@ void builtin_set(const std::vector<LispType> &args, LispType &result_sym)
       .cons_val = val.cons_val
     };
     break;
+  case LispType::Type::sequence:
+    g_variables[symbol_name] = {
+      .type = LispType::Type::sequence,
+      .seq_val = val.seq_val
+    };
+    break;
+  case LispType::Type::channel:
+    g_variables[symbol_name] = {
+      .type = LispType::Type::channel,
+      .chan_val = val.chan_val
+    };
+    break;
   default:
     throw std::runtime_error("set not implemented for type");
   }
@@ -320,135 +640,2146 @@ void builtin_cons(const std::vector<LispType> &args, LispType &result_sym)
     cons(args[0], make_nil(), result_sym);
     return;
   }
-  
-  cons(args[0], args[1], result_sym);
-}
+  
+  cons(args[0], args[1], result_sym);
+}
+
+void builtin_car(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("car requires 0 or 1 arg");
+  }
+  if (args[0].type == LispType::Type::nil) {
+    result_sym = make_nil();
+    return;
+  }
+  if (args[0].type != LispType::Type::cons) {
+    throw std::runtime_error("car arg0 must be cons cell");
+  }
+
+  car(args[0], result_sym);
+}
+
+void builtin_cdr(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("cdr requires 1 arg");
+  }
+  if (args[0].type == LispType::Type::nil) {
+    result_sym = make_nil();
+    return;
+  }
+  if (args[0].type != LispType::Type::cons) {
+    throw std::runtime_error("cdr arg0 must be cons cell");
+  }
+
+  cdr(args[0], result_sym);
+}
+
+void builtin_nth(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("nth requires 2 args");
+  }
+
+  nth(args[0], args[1], result_sym);
+}
+
+void builtin_list(const std::vector<LispType> &args, LispType &result_sym)
+{
+  make_list(args, result_sym);
+}
+
+void builtin_add(const std::vector<LispType> &args, LispType &result_sym)
+{
+  symbol_number_type result = 0.0;
+  for (auto it = args.cbegin(); it != args.cend(); ++it) {
+    const LispType &s = *it;
+    if (s.type != LispType::Type::number) {
+      throw std::runtime_error("symbol not a number");
+    }
+    result += s.number_val;
+  }
+  result_sym.type = LispType::Type::number;
+  result_sym.number_val = result;
+}
+
+void builtin_mul(const std::vector<LispType> &args, LispType &result_sym)
+{
+  symbol_number_type result = 1.0;
+  for (auto it = args.cbegin(); it != args.cend(); ++it) {
+    const LispType &s = *it;
+    if (s.type != LispType::Type::number) {
+      throw std::runtime_error("symbol not a number");
+    }
+    result *= s.number_val;
+  }
+  result_sym.type = LispType::Type::number;
+  result_sym.number_val = result;
+}
+
+
+void builtin_min(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() == 0 || args[0].type != LispType::Type::number) {
+    throw std::runtime_error("invalid args");
+  }
+  symbol_number_type result = args[0].number_val;
+  for (auto it = args.cbegin() + 1; it != args.cend(); ++it) {
+    const LispType &s = *it;
+    if (s.type != LispType::Type::number) {
+      throw std::runtime_error("symbol not a number");
+    }
+    result -= s.number_val;
+  }
+  result_sym.type = LispType::Type::number;
+  result_sym.number_val = result;
+}
+
+void builtin_div(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() == 0 || args[0].type != LispType::Type::number) {
+    throw std::runtime_error("invalid args");
+  }
+  symbol_number_type result = args[0].number_val;
+  for (auto it = args.cbegin() + 1; it != args.cend(); ++it) {
+    const LispType &s = *it;
+    if (s.type != LispType::Type::number) {
+      throw std::runtime_error("symbol not a number");
+    }
+    result /= s.number_val;
+  }
+  result_sym.type = LispType::Type::number;
+  result_sym.number_val = result;
+}
+
+void builtin_get(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("only 1 arg allowed in eval");
+  }
+  if (args[0].type != LispType::Type::symbol) {
+    throw std::runtime_error("get: arg0 must be symbol");
+  }
+  result_sym = g_variables[args[0].string_val];
+}
+
+template <typename Compare>
+void compare_numbers(const std::vector<LispType> &args, LispType &result_sym, Compare cmp)
+{
+  if (args.size() == 0) {
+    throw std::runtime_error("invalid args");
+  }
+  for (auto it = args.cbegin(); it != args.cend(); ++it) {
+    if (it->type != LispType::Type::number) {
+      throw std::runtime_error("symbol not a number");
+    }
+  }
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (!cmp(args[i - 1].number_val, args[i].number_val)) {
+      result_sym = make_nil();
+      return;
+    }
+  }
+  result_sym = make_symbol("t");
+}
+
+void builtin_less(const std::vector<LispType> &args, LispType &result_sym)
+{
+  compare_numbers(args, result_sym, std::less<symbol_number_type>());
+}
+
+void builtin_greater(const std::vector<LispType> &args, LispType &result_sym)
+{
+  compare_numbers(args, result_sym, std::greater<symbol_number_type>());
+}
+
+void builtin_equal_numbers(const std::vector<LispType> &args, LispType &result_sym)
+{
+  compare_numbers(args, result_sym, std::equal_to<symbol_number_type>());
+}
+
+// Steps through a list the same way nth does: a tail that is not a cons
+// cell counts as the last element.
+bool list_next(LispType &rest, LispType &elem)
+{
+  if (rest.type == LispType::Type::nil) {
+    return false;
+  }
+  if (rest.type != LispType::Type::cons) {
+    elem = rest;
+    rest = make_nil();
+    return true;
+  }
+  // keep the cell alive while rest gets overwritten
+  std::shared_ptr<ConsCell> cell = rest.cons_val;
+  elem = cell->head;
+  if (cell->tail != nullptr) {
+    rest = cell->tail->head;
+  } else {
+    rest = make_nil();
+  }
+  return true;
+}
+
+// Builds a list front to back without buffering the elements first.
+struct ListBuilder {
+  LispType result = make_nil();
+  ConsCell *last = nullptr;
+
+  void push_back(const LispType &elem)
+  {
+    LispType link = {
+      .type = LispType::Type::cons,
+      .cons_val = std::make_shared<ConsCell>(elem, std::make_shared<ConsCell>(make_nil()))
+    };
+    ConsCell *cell = link.cons_val.get();
+    if (last == nullptr) {
+      result = std::move(link);
+    } else {
+      last->tail->head = std::move(link);
+    }
+    last = cell;
+  }
+
+  // rest becomes the remainder of the list, shared not copied
+  void finish(const LispType &rest)
+  {
+    if (last == nullptr) {
+      result = rest;
+    } else {
+      last->tail->head = rest;
+    }
+  }
+};
+
+// A function argument for lmap, lfilter and reduce. Either a symbol naming
+// a builtin ('+) or a quoted call with some arguments already filled in,
+// (quote (* 2)) is called as (* 2 elem).
+struct Callable {
+  std::function<void(std::vector<LispType>&, LispType&)> func;
+  std::vector<LispType> bound_args;
+
+  void call(std::vector<LispType> &scratch, const LispType &a, LispType &result) const
+  {
+    eval_step();
+    scratch.assign(bound_args.cbegin(), bound_args.cend());
+    scratch.push_back(a);
+    func(scratch, result);
+  }
+
+  void call(std::vector<LispType> &scratch, const LispType &a, const LispType &b, LispType &result) const
+  {
+    eval_step();
+    scratch.assign(bound_args.cbegin(), bound_args.cend());
+    scratch.push_back(a);
+    scratch.push_back(b);
+    func(scratch, result);
+  }
+};
+
+Callable make_callable(const LispType &fn)
+{
+  Callable callable;
+  const LispType *name = &fn;
+
+  if (fn.type == LispType::Type::cons) {
+    name = &fn.cons_val->head;
+
+    LispType rest = fn.cons_val->tail != nullptr ? fn.cons_val->tail->head : make_nil();
+    LispType arg;
+    while (list_next(rest, arg)) {
+      if (arg.type == LispType::Type::cons) {
+        LispType evaluated;
+        eval(arg, evaluated);
+        callable.bound_args.push_back(evaluated);
+      } else if (arg.type == LispType::Type::variable) {
+        callable.bound_args.push_back(g_variables[arg.string_val]);
+      } else {
+        callable.bound_args.push_back(arg);
+      }
+    }
+  }
+
+  if (name->type != LispType::Type::symbol && name->type != LispType::Type::function) {
+    throw std::runtime_error("not a function");
+  }
+  auto it = g_builtins.find(name->string_val);
+  if (it == g_builtins.end()) {
+    std::stringstream ss;
+    ss << "unknown function: " << name->string_val;
+    throw std::runtime_error(ss.str());
+  }
+  callable.func = it->second;
+  return callable;
+}
+
+// Packed numbers, either owned or pointing into a mapped file. Elements
+// are stride apart so interleaved binary columns need no copy.
+struct NumberArray {
+  std::shared_ptr<const void> owner;
+  const symbol_number_type *data = nullptr;
+  size_t size = 0;
+  size_t stride = 1;
+
+  symbol_number_type operator[](size_t i) const
+  {
+    return data[i * stride];
+  }
+};
+
+// A LazySeq only describes how its elements are produced. Walking it is
+// done by a SeqCursor which pulls one element at a time through the whole
+// pipeline, so nothing is ever materialized.
+struct LazySeq {
+  enum Kind {
+    range,
+    list,
+    array,
+    map,
+    filter,
+    take,
+    drop
+  };
+
+  Kind kind = Kind::range;
+
+  // range: start + i * step for i >= first, while i < limit and the
+  // value has not reached end. array: elements first up to limit.
+  symbol_number_type start = 0.0;
+  symbol_number_type end = 0.0;
+  symbol_number_type step = 1.0;
+  bool infinite = false;
+  uint64_t first = 0;
+  uint64_t limit = std::numeric_limits<uint64_t>::max();
+
+  // list
+  LispType items;
+
+  // array
+  std::shared_ptr<const NumberArray> numbers;
+
+  // map, filter
+  std::shared_ptr<const Callable> fn;
+
+  // map, filter, take, drop
+  std::shared_ptr<const LazySeq> source;
+
+  // take, drop
+  uint64_t count = 0;
+};
+
+struct SeqCursor {
+  std::shared_ptr<const LazySeq> seq;
+  std::unique_ptr<SeqCursor> source;
+  uint64_t index = 0;
+  LispType rest;
+  std::vector<LispType> scratch;
+
+  explicit SeqCursor(const std::shared_ptr<const LazySeq> &_seq)
+    : seq(_seq)
+  {
+    if (seq->kind == LazySeq::Kind::range || seq->kind == LazySeq::Kind::array) {
+      index = seq->first;
+    } else if (seq->kind == LazySeq::Kind::list) {
+      rest = seq->items;
+    } else {
+      source = std::make_unique<SeqCursor>(seq->source);
+    }
+  }
+
+  bool next(LispType &elem)
+  {
+    eval_step();
+
+    LispType value;
+    switch (seq->kind) {
+    case LazySeq::Kind::range: {
+      if (index >= seq->limit) {
+        return false;
+      }
+      symbol_number_type v = seq->start + static_cast<symbol_number_type>(index) * seq->step;
+      if (!seq->infinite && (seq->step > 0 ? v >= seq->end : v <= seq->end)) {
+        return false;
+      }
+      ++index;
+      elem = make_number(v);
+      return true;
+    }
+    case LazySeq::Kind::list:
+      return list_next(rest, elem);
+    case LazySeq::Kind::array:
+      if (index >= seq->limit || index >= seq->numbers->size) {
+        return false;
+      }
+      elem = make_number((*seq->numbers)[index]);
+      ++index;
+      return true;
+    case LazySeq::Kind::map:
+      if (!source->next(value)) {
+        return false;
+      }
+      seq->fn->call(scratch, value, elem);
+      return true;
+    case LazySeq::Kind::filter:
+      while (source->next(value)) {
+        LispType keep;
+        seq->fn->call(scratch, value, keep);
+        if (keep.type != LispType::Type::nil) {
+          elem = value;
+          return true;
+        }
+      }
+      return false;
+    case LazySeq::Kind::take:
+      if (index >= seq->count || !source->next(elem)) {
+        return false;
+      }
+      ++index;
+      return true;
+    case LazySeq::Kind::drop:
+      for (; index < seq->count; ++index) {
+        if (!source->next(value)) {
+          return false;
+        }
+      }
+      return source->next(elem);
+    }
+    return false;
+  }
+};
+
+LispType make_sequence(const std::shared_ptr<const LazySeq> &seq)
+{
+  return {
+    .type = LispType::Type::sequence,
+    .seq_val = seq
+  };
+}
+
+std::shared_ptr<const LazySeq> as_seq(const LispType &val)
+{
+  if (val.type == LispType::Type::sequence) {
+    return val.seq_val;
+  }
+  if (val.type != LispType::Type::cons && val.type != LispType::Type::nil) {
+    throw std::runtime_error("not a sequence");
+  }
+  auto seq = std::make_shared<LazySeq>();
+  seq->kind = LazySeq::Kind::list;
+  seq->items = val;
+  return seq;
+}
+
+uint64_t seq_count_arg(const LispType &val, const char *fn_name)
+{
+  if (val.type != LispType::Type::number || !(val.number_val >= 0)) {
+    std::stringstream ss;
+    ss << fn_name << " arg0 must be positive number";
+    throw std::runtime_error(ss.str());
+  }
+  if (val.number_val >= static_cast<symbol_number_type>(std::numeric_limits<uint64_t>::max())) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  return static_cast<uint64_t>(val.number_val);
+}
+
+uint64_t saturating_add(uint64_t a, uint64_t b)
+{
+  return a > std::numeric_limits<uint64_t>::max() - b ? std::numeric_limits<uint64_t>::max() : a + b;
+}
+
+// take and drop get folded into ranges and other takes/drops, and pushed
+// below map since map never changes the number of elements
+std::shared_ptr<const LazySeq> seq_take(uint64_t n, const std::shared_ptr<const LazySeq> &src)
+{
+  auto seq = std::make_shared<LazySeq>(*src);
+  switch (src->kind) {
+  case LazySeq::Kind::range:
+  case LazySeq::Kind::array:
+    seq->limit = std::min(src->limit, saturating_add(src->first, n));
+    break;
+  case LazySeq::Kind::take:
+    seq->count = std::min(src->count, n);
+    break;
+  case LazySeq::Kind::map:
+    seq->source = seq_take(n, src->source);
+    break;
+  default:
+    *seq = LazySeq();
+    seq->kind = LazySeq::Kind::take;
+    seq->count = n;
+    seq->source = src;
+    break;
+  }
+  return seq;
+}
+
+std::shared_ptr<const LazySeq> seq_drop(uint64_t n, const std::shared_ptr<const LazySeq> &src)
+{
+  auto seq = std::make_shared<LazySeq>(*src);
+  switch (src->kind) {
+  case LazySeq::Kind::range:
+  case LazySeq::Kind::array:
+    seq->first = saturating_add(src->first, n);
+    break;
+  case LazySeq::Kind::drop:
+    seq->count = saturating_add(src->count, n);
+    break;
+  case LazySeq::Kind::map:
+    seq->source = seq_drop(n, src->source);
+    break;
+  default:
+    *seq = LazySeq();
+    seq->kind = LazySeq::Kind::drop;
+    seq->count = n;
+    seq->source = src;
+    break;
+  }
+  return seq;
+}
+
+void builtin_range(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() > 3) {
+    throw std::runtime_error("range requires at most 3 args");
+  }
+  for (auto it = args.cbegin(); it != args.cend(); ++it) {
+    if (it->type != LispType::Type::number) {
+      throw std::runtime_error("symbol not a number");
+    }
+  }
+
+  auto seq = std::make_shared<LazySeq>();
+  seq->kind = LazySeq::Kind::range;
+  if (args.size() == 0) {
+    seq->infinite = true;
+  } else if (args.size() == 1) {
+    seq->end = args[0].number_val;
+  } else {
+    seq->start = args[0].number_val;
+    seq->end = args[1].number_val;
+  }
+  if (args.size() == 3) {
+    seq->step = args[2].number_val;
+    if (seq->step == 0) {
+      throw std::runtime_error("range step must not be 0");
+    }
+  }
+
+  result_sym = make_sequence(seq);
+}
+
+void builtin_lmap(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("lmap requires 2 args");
+  }
+  auto seq = std::make_shared<LazySeq>();
+  seq->kind = LazySeq::Kind::map;
+  seq->fn = std::make_shared<const Callable>(make_callable(args[0]));
+  seq->source = as_seq(args[1]);
+  result_sym = make_sequence(seq);
+}
+
+void builtin_lfilter(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("lfilter requires 2 args");
+  }
+  auto seq = std::make_shared<LazySeq>();
+  seq->kind = LazySeq::Kind::filter;
+  seq->fn = std::make_shared<const Callable>(make_callable(args[0]));
+  seq->source = as_seq(args[1]);
+  result_sym = make_sequence(seq);
+}
+
+void builtin_take(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("take requires 2 args");
+  }
+  result_sym = make_sequence(seq_take(seq_count_arg(args[0], "take"), as_seq(args[1])));
+}
+
+void builtin_drop(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("drop requires 2 args");
+  }
+  result_sym = make_sequence(seq_drop(seq_count_arg(args[0], "drop"), as_seq(args[1])));
+}
+
+void builtin_reduce(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2 && args.size() != 3) {
+    throw std::runtime_error("reduce requires 2 or 3 args");
+  }
+  Callable fn = make_callable(args[0]);
+  SeqCursor cursor(as_seq(args.back()));
+  std::vector<LispType> scratch;
+
+  LispType acc;
+  if (args.size() == 3) {
+    acc = args[1];
+  } else if (!cursor.next(acc)) {
+    // like (+) on an empty sequence
+    scratch = fn.bound_args;
+    fn.func(scratch, result_sym);
+    return;
+  }
+
+  LispType elem;
+  while (cursor.next(elem)) {
+    fn.call(scratch, acc, elem, acc);
+  }
+  result_sym = acc;
+}
+
+void builtin_collect(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("collect requires 1 arg");
+  }
+  if (args[0].type != LispType::Type::sequence) {
+    result_sym = args[0];
+    return;
+  }
+
+  SeqCursor cursor(args[0].seq_val);
+  ListBuilder list;
+  LispType elem;
+  while (cursor.next(elem)) {
+    list.push_back(elem);
+  }
+  result_sym = list.result;
+}
+
+// ---- list library ----
+//
+// All of these walk the cells in a loop, so they work on lists of any
+// length with constant stack. Like nth, a tail that is not a cons cell
+// counts as the last element. Lazy sequences are accepted as well.
+
+template <typename F>
+void for_each_element(const LispType &coll, F f)
+{
+  if (coll.type == LispType::Type::sequence) {
+    SeqCursor cursor(coll.seq_val);
+    LispType elem;
+    while (cursor.next(elem)) {
+      f(elem);
+    }
+    return;
+  }
+  if (coll.type != LispType::Type::cons && coll.type != LispType::Type::nil) {
+    throw std::runtime_error("not a sequence");
+  }
+
+  const LispType *rest = &coll;
+  while (rest->type == LispType::Type::cons) {
+    const ConsCell *cell = rest->cons_val.get();
+    f(cell->head);
+    if (cell->tail == nullptr) {
+      return;
+    }
+    rest = &cell->tail->head;
+  }
+  if (rest->type != LispType::Type::nil) {
+    f(*rest);
+  }
+}
+
+void builtin_length(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("length requires 1 arg");
+  }
+  uint64_t length = 0;
+  for_each_element(args[0], [&length](const LispType &elem) { ++length; });
+  result_sym = make_number(length);
+}
+
+// copies every list but the last one, which becomes the shared tail
+void builtin_append(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() == 0) {
+    result_sym = make_nil();
+    return;
+  }
+  ListBuilder list;
+  for (auto it = args.cbegin(); it + 1 != args.cend(); ++it) {
+    for_each_element(*it, [&list](const LispType &elem) { list.push_back(elem); });
+  }
+  if (args.back().type == LispType::Type::sequence) {
+    for_each_element(args.back(), [&list](const LispType &elem) { list.push_back(elem); });
+  } else {
+    list.finish(args.back());
+  }
+  result_sym = list.result;
+}
+
+void builtin_reverse(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("reverse requires 1 arg");
+  }
+  LispType result = make_nil();
+  for_each_element(args[0], [&result](const LispType &elem) {
+    cons(elem, result, result);
+  });
+  result_sym = result;
+}
+
+void builtin_map(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("map requires 2 args");
+  }
+  Callable fn = make_callable(args[0]);
+  std::vector<LispType> scratch;
+  ListBuilder list;
+  for_each_element(args[1], [&](const LispType &elem) {
+    LispType mapped;
+    fn.call(scratch, elem, mapped);
+    list.push_back(mapped);
+  });
+  result_sym = list.result;
+}
+
+void builtin_filter(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("filter requires 2 args");
+  }
+  Callable fn = make_callable(args[0]);
+  std::vector<LispType> scratch;
+  ListBuilder list;
+  for_each_element(args[1], [&](const LispType &elem) {
+    LispType keep;
+    fn.call(scratch, elem, keep);
+    if (keep.type != LispType::Type::nil) {
+      list.push_back(elem);
+    }
+  });
+  result_sym = list.result;
+}
+
+// numbers and symbols compare naturally unless sort got a predicate
+struct SortLess {
+  const Callable *fn = nullptr;
+  std::vector<LispType> scratch;
+
+  bool operator()(const LispType &a, const LispType &b)
+  {
+    if (fn != nullptr) {
+      LispType less;
+      fn->call(scratch, a, b, less);
+      return less.type != LispType::Type::nil;
+    }
+    if (a.type == LispType::Type::number && b.type == LispType::Type::number) {
+      return a.number_val < b.number_val;
+    }
+    if (a.type == LispType::Type::symbol && b.type == LispType::Type::symbol) {
+      return a.string_val < b.string_val;
+    }
+    throw std::runtime_error("sort: cant compare elements, pass a predicate");
+  }
+};
+
+ConsCell *next_cell(ConsCell *cell)
+{
+  return cell->tail->head.type == LispType::Type::cons ? cell->tail->head.cons_val.get() : nullptr;
+}
+
+std::shared_ptr<ConsCell> cut_after(ConsCell *cell)
+{
+  if (cell->tail->head.type != LispType::Type::cons) {
+    return nullptr;
+  }
+  // only touch the link, the rest of the LispType is nil already
+  LispType &link = cell->tail->head;
+  link.type = LispType::Type::nil;
+  return std::move(link.cons_val);
+}
+
+void link_after(ConsCell *cell, std::shared_ptr<ConsCell> &&rest)
+{
+  LispType &link = cell->tail->head;
+  link.type = LispType::Type::cons;
+  link.cons_val = std::move(rest);
+}
+
+// Stable merge of two detached runs. Returns the last cell of the result.
+ConsCell *merge_runs(std::shared_ptr<ConsCell> a, std::shared_ptr<ConsCell> b,
+                     std::shared_ptr<ConsCell> &head, SortLess &less)
+{
+  ConsCell *last = nullptr;
+  while (a != nullptr || b != nullptr) {
+    std::shared_ptr<ConsCell> &from = a == nullptr || (b != nullptr && less(b->head, a->head)) ? b : a;
+    std::shared_ptr<ConsCell> cell = std::move(from);
+    from = cut_after(cell.get());
+
+    ConsCell *raw = cell.get();
+    if (last == nullptr) {
+      head = std::move(cell);
+    } else {
+      link_after(last, std::move(cell));
+    }
+    last = raw;
+
+    if (a == nullptr || b == nullptr) {
+      // append whatever is left in one go
+      std::shared_ptr<ConsCell> &left = a != nullptr ? a : b;
+      if (left != nullptr) {
+        ConsCell *end = left.get();
+        for (ConsCell *next = next_cell(end); next != nullptr; next = next_cell(end)) {
+          end = next;
+        }
+        link_after(last, std::move(left));
+        last = end;
+      }
+      break;
+    }
+  }
+  return last;
+}
+
+// Bottom-up merge sort that relinks a fresh copy of the cells, runs of
+// width 1, 2, 4, ... get merged until only one is left.
+void builtin_sort(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1 && args.size() != 2) {
+    throw std::runtime_error("sort requires 1 or 2 args");
+  }
+  Callable fn;
+  SortLess less;
+  if (args.size() == 2) {
+    fn = make_callable(args[0]);
+    less.fn = &fn;
+  }
+
+  ListBuilder copy;
+  for_each_element(args.back(), [&copy](const LispType &elem) { copy.push_back(elem); });
+  if (copy.result.type == LispType::Type::nil) {
+    result_sym = make_nil();
+    return;
+  }
+
+  std::shared_ptr<ConsCell> list = std::move(copy.result.cons_val);
+  for (size_t width = 1;; width *= 2) {
+    std::shared_ptr<ConsCell> remaining = std::move(list);
+    ConsCell *last = nullptr;
+    size_t merges = 0;
+
+    while (remaining != nullptr) {
+      std::shared_ptr<ConsCell> a = std::move(remaining);
+      ConsCell *end = a.get();
+      for (size_t i = 1; i < width && next_cell(end) != nullptr; ++i) {
+        end = next_cell(end);
+      }
+      std::shared_ptr<ConsCell> b = cut_after(end);
+      if (b != nullptr) {
+        end = b.get();
+        for (size_t i = 1; i < width && next_cell(end) != nullptr; ++i) {
+          end = next_cell(end);
+        }
+        remaining = cut_after(end);
+      }
+
+      std::shared_ptr<ConsCell> merged;
+      ConsCell *merged_last = merge_runs(std::move(a), std::move(b), merged, less);
+      if (last == nullptr) {
+        list = std::move(merged);
+      } else {
+        link_after(last, std::move(merged));
+      }
+      last = merged_last;
+      ++merges;
+    }
+
+    if (merges <= 1) {
+      break;
+    }
+  }
+
+  result_sym = {
+    .type = LispType::Type::cons,
+    .cons_val = list
+  };
+}
+
+void nth_seq(const LispType &seq_type, uint64_t index, LispType &result)
+{
+  const LazySeq &seq = *seq_type.seq_val;
+  if (seq.kind == LazySeq::Kind::array) {
+    uint64_t i = saturating_add(seq.first, index);
+    if (i < seq.limit && i < seq.numbers->size) {
+      result = make_number((*seq.numbers)[i]);
+    } else {
+      result = make_nil();
+    }
+    return;
+  }
+
+  SeqCursor cursor(seq_type.seq_val);
+  for (uint64_t i = 0; i <= index; ++i) {
+    if (!cursor.next(result)) {
+      result = make_nil();
+      return;
+    }
+  }
+}
+
+// ---- column loaders ----
+
+struct MappedFile {
+  void *mem = nullptr;
+  size_t size = 0;
+
+  explicit MappedFile(const std::string &path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::stringstream ss;
+      ss << "cant open " << path << ": " << std::strerror(errno);
+      throw std::runtime_error(ss.str());
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error(std::strerror(errno));
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size > 0) {
+      mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mem == MAP_FAILED) {
+        mem = nullptr;
+        close(fd);
+        std::stringstream ss;
+        ss << "cant mmap " << path << ": " << std::strerror(errno);
+        throw std::runtime_error(ss.str());
+      }
+      madvise(mem, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile &other) = delete;
+  MappedFile& operator=(const MappedFile &other) = delete;
+
+  ~MappedFile() {
+    if (mem != nullptr) {
+      munmap(mem, size);
+    }
+  }
+
+  const char *begin() const { return static_cast<const char*>(mem); }
+  const char *end() const { return begin() + size; }
+};
+
+const char *find_char(const char *begin, const char *end, char c)
+{
+  const void *found = std::memchr(begin, c, static_cast<size_t>(end - begin));
+  return found != nullptr ? static_cast<const char*>(found) : end;
+}
+
+void trim_field(const char *&begin, const char *&end)
+{
+  while (begin < end && (*begin == ' ' || *begin == '\t')) {
+    ++begin;
+  }
+  while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+    --end;
+  }
+}
+
+bool parse_number(const char *begin, const char *end, symbol_number_type &value)
+{
+  if (begin < end && *begin == '+') {
+    ++begin;
+  }
+  auto res = std::from_chars(begin, end, value);
+  return res.ec == std::errc() && res.ptr == end;
+}
+
+struct CsvChunk {
+  std::vector<std::vector<symbol_number_type>> columns;
+  std::string error;
+};
+
+// Splits lines into fields without copying. Empty fields become nan, empty
+// lines are skipped.
+void parse_csv_chunk(const char *begin, const char *end, size_t num_columns, CsvChunk &chunk)
+{
+  chunk.columns.resize(num_columns);
+
+  for (const char *line = begin; line < end;) {
+    const char *line_end = find_char(line, end, '\n');
+    const char *next_line = line_end < end ? line_end + 1 : end;
+
+    const char *trimmed_begin = line;
+    const char *trimmed_end = line_end;
+    trim_field(trimmed_begin, trimmed_end);
+    if (trimmed_begin == trimmed_end) {
+      line = next_line;
+      continue;
+    }
+
+    size_t col = 0;
+    for (const char *field = line;; ++col) {
+      const char *field_end = find_char(field, line_end, ',');
+      if (col >= num_columns) {
+        chunk.error = "too many columns in row";
+        return;
+      }
+
+      const char *value_begin = field;
+      const char *value_end = field_end;
+      trim_field(value_begin, value_end);
+      symbol_number_type value = std::numeric_limits<symbol_number_type>::quiet_NaN();
+      if (value_begin != value_end && !parse_number(value_begin, value_end, value)) {
+        chunk.error = "not a number: " + std::string(value_begin, value_end);
+        return;
+      }
+      chunk.columns[col].push_back(value);
+
+      if (field_end == line_end) {
+        break;
+      }
+      field = field_end + 1;
+    }
+    if (col + 1 != num_columns) {
+      chunk.error = "too few columns in row";
+      return;
+    }
+    line = next_line;
+  }
+}
+
+constexpr size_t LOADER_MIN_CHUNK_SIZE = 1 << 20;
+
+size_t loader_num_threads(size_t size)
+{
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  return std::max<size_t>(1, std::min(num_threads, size / LOADER_MIN_CHUNK_SIZE));
+}
+
+std::string column_name(size_t col)
+{
+  std::stringstream ss;
+  ss << "col" << col;
+  return ss.str();
+}
+
+LispType make_array_sequence(const std::shared_ptr<const NumberArray> &array)
+{
+  auto seq = std::make_shared<LazySeq>();
+  seq->kind = LazySeq::Kind::array;
+  seq->numbers = array;
+  return make_sequence(seq);
+}
+
+const std::string& loader_path_arg(const std::vector<LispType> &args, const char *fn_name)
+{
+  if (args.empty() || args[0].type != LispType::Type::symbol) {
+    std::stringstream ss;
+    ss << fn_name << " arg0 must be a file name";
+    throw std::runtime_error(ss.str());
+  }
+  return args[0].string_val;
+}
+
+// (load-columns "file.csv") binds every column of the file as a packed
+// numeric sequence. Column names come from the header line or are col0,
+// col1, ... when the first line is numeric. Returns the bound names.
+void builtin_load_columns(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("load-columns requires 1 arg");
+  }
+  MappedFile file(loader_path_arg(args, "load-columns"));
+
+  // the first line tells the number of columns and whether there are names
+  const char *first_line_end = find_char(file.begin(), file.end(), '\n');
+  std::vector<std::string> names;
+  bool has_header = false;
+  for (const char *field = file.begin(); field < first_line_end || names.empty();) {
+    const char *field_end = find_char(field, first_line_end, ',');
+    const char *value_begin = field;
+    const char *value_end = field_end;
+    trim_field(value_begin, value_end);
+
+    symbol_number_type value;
+    if (value_begin != value_end && !parse_number(value_begin, value_end, value)) {
+      has_header = true;
+    }
+    names.push_back(std::string(value_begin, value_end));
+
+    if (field_end == first_line_end) {
+      break;
+    }
+    field = field_end + 1;
+  }
+  for (size_t col = 0; col < names.size(); ++col) {
+    if (!has_header || names[col].empty()) {
+      names[col] = column_name(col);
+    }
+  }
+
+  const char *data_begin = has_header ? std::min(first_line_end + 1, file.end()) : file.begin();
+  size_t data_size = static_cast<size_t>(file.end() - data_begin);
+
+  // split at line boundaries and parse the chunks in parallel
+  size_t num_chunks = loader_num_threads(data_size);
+  std::vector<const char*> bounds = { data_begin };
+  for (size_t i = 1; i < num_chunks; ++i) {
+    const char *bound = std::max(bounds.back(), data_begin + data_size / num_chunks * i);
+    bound = find_char(bound, file.end(), '\n');
+    bounds.push_back(bound < file.end() ? bound + 1 : bound);
+  }
+  bounds.push_back(file.end());
+
+  std::vector<CsvChunk> chunks(num_chunks);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_chunks; ++i) {
+    threads.emplace_back(parse_csv_chunk, bounds[i], bounds[i + 1], names.size(), std::ref(chunks[i]));
+  }
+  parse_csv_chunk(bounds[0], bounds[1], names.size(), chunks[0]);
+  for (auto it = threads.begin(); it != threads.end(); ++it) {
+    it->join();
+  }
+  for (auto it = chunks.cbegin(); it != chunks.cend(); ++it) {
+    if (!it->error.empty()) {
+      throw std::runtime_error("load-columns: " + it->error);
+    }
+  }
+
+  std::vector<LispType> bound_names;
+  for (size_t col = 0; col < names.size(); ++col) {
+    auto values = std::make_shared<std::vector<symbol_number_type>>(std::move(chunks[0].columns[col]));
+    for (size_t i = 1; i < num_chunks; ++i) {
+      const std::vector<symbol_number_type> &part = chunks[i].columns[col];
+      values->insert(values->end(), part.cbegin(), part.cend());
+    }
+
+    auto array = std::make_shared<NumberArray>();
+    array->data = values->data();
+    array->size = values->size();
+    array->owner = values;
+
+    g_variables[names[col]] = make_array_sequence(array);
+    bound_names.push_back(make_symbol(names[col]));
+  }
+  make_list(bound_names, result_sym);
+}
+
+// (load-binary "file.bin" [columns]) binds col0, col1, ... to the
+// little-endian doubles of the file, stored row by row. The columns point
+// straight into the mapping, nothing gets parsed or copied.
+void builtin_load_binary(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1 && args.size() != 2) {
+    throw std::runtime_error("load-binary requires 1 or 2 args");
+  }
+  const std::string &path = loader_path_arg(args, "load-binary");
+  size_t num_columns = 1;
+  if (args.size() == 2) {
+    if (args[1].type != LispType::Type::number || args[1].number_val < 1) {
+      throw std::runtime_error("load-binary arg1 must be positive number");
+    }
+    num_columns = static_cast<size_t>(args[1].number_val);
+  }
+
+  auto file = std::make_shared<MappedFile>(path);
+  size_t row_size = num_columns * sizeof(symbol_number_type);
+  if (file->size % row_size != 0) {
+    throw std::runtime_error("load-binary: file size is not a multiple of the row size");
+  }
+  size_t num_rows = file->size / row_size;
+
+  std::shared_ptr<const void> owner = file;
+  const symbol_number_type *data = reinterpret_cast<const symbol_number_type*>(file->begin());
+  size_t stride = num_columns;
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  // swap into an owned copy, column by column
+  auto swapped = std::make_shared<std::vector<symbol_number_type>>(num_rows * num_columns);
+  for (size_t col = 0; col < num_columns; ++col) {
+    for (size_t row = 0; row < num_rows; ++row) {
+      uint64_t bits;
+      std::memcpy(&bits, file->begin() + (row * num_columns + col) * sizeof(bits), sizeof(bits));
+      bits = __builtin_bswap64(bits);
+      std::memcpy(&(*swapped)[col * num_rows + row], &bits, sizeof(bits));
+    }
+  }
+  owner = swapped;
+  data = swapped->data();
+  stride = 1;
+#endif
+
+  std::vector<LispType> bound_names;
+  for (size_t col = 0; col < num_columns; ++col) {
+    auto array = std::make_shared<NumberArray>();
+    array->owner = owner;
+    array->size = num_rows;
+    array->stride = stride;
+    array->data = stride == 1 ? data + col * num_rows : data + col;
+
+    std::string name = column_name(col);
+    g_variables[name] = make_array_sequence(array);
+    bound_names.push_back(make_symbol(name));
+  }
+  make_list(bound_names, result_sym);
+}
+
+// ---- green threads ----
+//
+// Tasks are ucontext coroutines on pooled stacks, scheduled cooperatively
+// from a run queue. They switch at yield and whenever they block on a
+// channel, a timer or a file descriptor. The REPL itself is the main task
+// running on the process stack, so spawned tasks run while it waits for
+// input. Blocked tasks are woken by the epoll reactor, which also handles
+// timers through the epoll_wait timeout.
+
+// Stacks are carved out of slabs with an inaccessible guard page below
+// each one, so every task still costs two mappings. eval checks the
+// remaining stack and fails the task once less than TASK_STACK_MARGIN is
+// left. Deep recursion anywhere else hits the guard page and takes the
+// whole process down, but never scribbles over another task's stack.
+constexpr size_t TASK_STACK_SIZE = 4 * 1024 * 1024;
+constexpr size_t TASK_STACK_MARGIN = 64 * 1024;
+constexpr size_t TASK_STACKS_PER_SLAB = 16;
+// pooled stacks beyond this get their memory handed back to the kernel
+constexpr size_t TASK_STACK_POOL_SIZE = 1024;
+constexpr uint64_t REACTOR_POLL_INTERVAL = 64;
+
+struct Task {
+  uint64_t id = 0;
+  ucontext_t context;
+  char *stack = nullptr;
+  // eval refuses to go deeper than this
+  const char *stack_limit = nullptr;
+  LispType code;
+  bool done = false;
+  // set when the task is woken because nothing can ever wake it
+  bool deadlocked = false;
+  std::shared_ptr<EvalBudget> budget;
+};
+
+struct Channel {
+  size_t capacity = 1;
+  bool closed = false;
+  std::deque<LispType> buffer;
+  std::deque<Task*> senders;
+  std::deque<Task*> receivers;
+};
+
+typedef std::chrono::steady_clock::time_point task_deadline_type;
+
+struct TaskTimer {
+  task_deadline_type deadline;
+  Task *task;
+
+  bool operator>(const TaskTimer &other) const
+  {
+    return deadline > other.deadline;
+  }
+};
+
+Task g_main_task;
+Task *g_current_task = &g_main_task;
+uint64_t g_next_task_id = 1;
+uint64_t g_task_switches = 0;
+std::map<uint64_t, std::unique_ptr<Task>> g_tasks;
+std::deque<Task*> g_run_queue;
+std::vector<uint64_t> g_dead_tasks;
+std::vector<char*> g_stack_pool;
+
+struct FdWaiter {
+  Task *task;
+  uint32_t events;
+};
+
+int g_epoll_fd = -1;
+// every fd is registered once with the union of what its waiters want
+std::map<int, std::vector<FdWaiter>> g_fd_waiters;
+std::priority_queue<TaskTimer, std::vector<TaskTimer>, std::greater<TaskTimer>> g_timers;
+
+// Returns the lowest address of a stack. Slabs are never unmapped.
+char *allocate_stack()
+{
+  if (g_stack_pool.empty()) {
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t stride = page_size + TASK_STACK_SIZE;
+    size_t size = TASK_STACKS_PER_SLAB * stride;
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      throw std::runtime_error("cant allocate task stack");
+    }
+    char *slab = static_cast<char*>(mem);
+    for (size_t i = 0; i < TASK_STACKS_PER_SLAB; ++i) {
+      if (mprotect(slab + i * stride, page_size, PROT_NONE) != 0) {
+        munmap(mem, size);
+        throw std::runtime_error("cant allocate task stack");
+      }
+    }
+    for (size_t i = TASK_STACKS_PER_SLAB; i > 0; --i) {
+      g_stack_pool.push_back(slab + (i - 1) * stride + page_size);
+    }
+  }
+
+  char *stack = g_stack_pool.back();
+  g_stack_pool.pop_back();
+  return stack;
+}
+
+void release_stack(char *stack)
+{
+  if (g_stack_pool.size() >= TASK_STACK_POOL_SIZE) {
+    madvise(stack, TASK_STACK_SIZE, MADV_DONTNEED);
+  }
+  g_stack_pool.push_back(stack);
+}
+
+// Called on every eval, fails a deeply recursing task before it reaches
+// the guard page.
+inline void check_task_stack()
+{
+  char probe;
+  if (&probe < g_current_task->stack_limit) {
+    throw std::runtime_error("stack overflow in task");
+  }
+}
+
+void epoll_update(int fd, int op, uint32_t events)
+{
+  epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  epoll_ctl(g_epoll_fd, op, fd, &ev);
+}
+
+// Wakes the waiters of fd that got what they asked for and re-registers
+// the fd for the remaining ones.
+void wake_fd_waiters(int fd, uint32_t ready)
+{
+  auto it = g_fd_waiters.find(fd);
+  if (it == g_fd_waiters.end()) {
+    return;
+  }
+  std::vector<FdWaiter> &waiters = it->second;
+  uint32_t remaining = 0;
+  for (auto w = waiters.begin(); w != waiters.end();) {
+    if ((w->events & ready) != 0 || (ready & (EPOLLERR | EPOLLHUP)) != 0) {
+      g_run_queue.push_back(w->task);
+      w = waiters.erase(w);
+    } else {
+      remaining |= w->events;
+      ++w;
+    }
+  }
+  if (waiters.empty()) {
+    epoll_update(fd, EPOLL_CTL_DEL, 0);
+    g_fd_waiters.erase(it);
+  } else {
+    epoll_update(fd, EPOLL_CTL_MOD, remaining);
+  }
+}
+
+void reap_dead_tasks()
+{
+  for (auto it = g_dead_tasks.cbegin(); it != g_dead_tasks.cend(); ++it) {
+    auto task = g_tasks.find(*it);
+    release_stack(task->second->stack);
+    g_tasks.erase(task);
+  }
+  g_dead_tasks.clear();
+}
+
+void wake_task(Task *task)
+{
+  g_run_queue.push_back(task);
+}
+
+// Moves expired timers and ready file descriptors onto the run queue. Only
+// sleeps in epoll_wait when block is set and there is something to wait for.
+void reactor_poll(bool block)
+{
+  auto now = std::chrono::steady_clock::now();
+  while (!g_timers.empty() && g_timers.top().deadline <= now) {
+    wake_task(g_timers.top().task);
+    g_timers.pop();
+  }
+  if (g_fd_waiters.empty() && (g_timers.empty() || !g_run_queue.empty() || !block)) {
+    return;
+  }
+
+  int timeout = -1;
+  if (!block || !g_run_queue.empty()) {
+    timeout = 0;
+  } else if (!g_timers.empty()) {
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(g_timers.top().deadline - now);
+    timeout = static_cast<int>(wait.count()) + 1;
+  }
+
+  if (!g_fd_waiters.empty()) {
+    epoll_event events[64];
+    int n = epoll_wait(g_epoll_fd, events, 64, timeout);
+    for (int i = 0; i < n; ++i) {
+      wake_fd_waiters(events[i].data.fd, events[i].events);
+    }
+  } else if (timeout > 0) {
+    usleep(static_cast<useconds_t>(timeout) * 1000);
+  }
+
+  now = std::chrono::steady_clock::now();
+  while (!g_timers.empty() && g_timers.top().deadline <= now) {
+    wake_task(g_timers.top().task);
+    g_timers.pop();
+  }
+}
+
+Task *scheduler_next()
+{
+  while (g_keep_running) {
+    if (g_run_queue.empty() || ++g_task_switches % REACTOR_POLL_INTERVAL == 0) {
+      reactor_poll(g_run_queue.empty());
+    }
+    if (!g_run_queue.empty()) {
+      Task *next = g_run_queue.front();
+      g_run_queue.pop_front();
+      return next;
+    }
+    if (g_fd_waiters.empty() && g_timers.empty()) {
+      break;
+    }
+  }
+  // Nobody can ever run again. The main task must be among the blocked
+  // ones, wake it up so it can report the deadlock.
+  g_main_task.deadlocked = true;
+  return &g_main_task;
+}
+
+// The current task must already be queued somewhere (or be done) before
+// calling this, otherwise it never runs again.
+void scheduler_switch()
+{
+  Task *prev = g_current_task;
+  Task *next = scheduler_next();
+  if (next != prev) {
+    g_current_task = next;
+    eval_budget_save();
+    prev->budget = g_eval_budget_shared;
+    swapcontext(&prev->context, &next->context);
+    eval_budget_load(prev->budget);
+  }
+  reap_dead_tasks();
+}
+
+// Blocks the current task, which has put itself on waiters. Throws when
+// it got woken because of a deadlock instead.
+void scheduler_block(std::deque<Task*> &waiters)
+{
+  Task *self = g_current_task;
+  waiters.push_back(self);
+  scheduler_switch();
+  if (self->deadlocked) {
+    self->deadlocked = false;
+    waiters.erase(std::remove(waiters.begin(), waiters.end(), self), waiters.end());
+    throw std::runtime_error("deadlock: all tasks are blocked");
+  }
+}
+
+void scheduler_yield()
+{
+  wake_task(g_current_task);
+  scheduler_switch();
+}
+
+void scheduler_sleep(std::chrono::milliseconds duration)
+{
+  g_timers.push({ std::chrono::steady_clock::now() + duration, g_current_task });
+  scheduler_switch();
+}
+
+// Returns false for descriptors epoll cant watch (regular files), those
+// never block anyway.
+bool scheduler_wait_fd(int fd, uint32_t events)
+{
+  if (g_epoll_fd < 0) {
+    g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epoll_fd < 0) {
+      throw std::runtime_error(std::strerror(errno));
+    }
+  }
+
+  // several tasks may wait on the same fd, it is only added once
+  std::vector<FdWaiter> &waiters = g_fd_waiters[fd];
+  uint32_t interest = events;
+  for (auto it = waiters.cbegin(); it != waiters.cend(); ++it) {
+    interest |= it->events;
+  }
+
+  epoll_event ev;
+  ev.events = interest;
+  ev.data.fd = fd;
+  if (epoll_ctl(g_epoll_fd, waiters.empty() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) != 0) {
+    int error = errno;
+    if (waiters.empty()) {
+      g_fd_waiters.erase(fd);
+    }
+    if (error == EPERM) {
+      return false;
+    }
+    std::stringstream ss;
+    ss << "wait-fd: cant wait on fd " << fd << ": " << std::strerror(error);
+    throw std::runtime_error(ss.str());
+  }
+
+  waiters.push_back({ g_current_task, events });
+  scheduler_switch();
+  return true;
+}
+
+void task_main()
+{
+  Task *self = g_current_task;
+  eval_budget_load(self->budget);
+  try {
+    LispType result;
+    eval(self->code, result);
+  } catch (std::exception &e) {
+    std::cout << "Error in task " << self->id << ": " << e.what() << "\n";
+  }
+  self->done = true;
+  self->code = make_nil();
+  // the stack gets released by whichever task runs next
+  g_dead_tasks.push_back(self->id);
+  scheduler_switch();
+}
+
+bool scheduler_has_tasks()
+{
+  return !g_tasks.empty();
+}
+
+void builtin_spawn(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("spawn requires 1 arg");
+  }
+  if (args[0].type != LispType::Type::cons) {
+    throw std::runtime_error("spawn arg0 must be a quoted form");
+  }
+
+  auto task = std::make_unique<Task>();
+  task->id = g_next_task_id++;
+  task->code = args[0];
+  // spawned tasks burn the fuel of their parent, so spawning cant multiply
+  // a limited evaluation's budget
+  eval_budget_save();
+  task->budget = g_eval_budget_shared;
+  task->stack = allocate_stack();
+
+  task->stack_limit = task->stack + TASK_STACK_MARGIN;
+
+  getcontext(&task->context);
+  task->context.uc_stack.ss_sp = task->stack;
+  task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+  task->context.uc_link = nullptr;
+  makecontext(&task->context, task_main, 0);
+
+  wake_task(task.get());
+  result_sym = make_number(task->id);
+  g_tasks[task->id] = std::move(task);
+}
+
+void builtin_yield(const std::vector<LispType> &args, LispType &result_sym)
+{
+  scheduler_yield();
+  result_sym = make_nil();
+}
+
+void builtin_sleep(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1 || args[0].type != LispType::Type::number || args[0].number_val < 0) {
+    throw std::runtime_error("sleep arg0 must be positive number of ms");
+  }
+  scheduler_sleep(std::chrono::milliseconds(static_cast<long long>(args[0].number_val)));
+  result_sym = make_nil();
+}
+
+void builtin_wait_fd(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() == 0 || args.size() > 2 || args[0].type != LispType::Type::number) {
+    throw std::runtime_error("wait-fd arg0 must be a file descriptor");
+  }
+  uint32_t events = EPOLLIN;
+  if (args.size() == 2) {
+    if (args[1].type != LispType::Type::symbol
+        || (args[1].string_val != "read" && args[1].string_val != "write")) {
+      throw std::runtime_error("wait-fd arg1 must be 'read or 'write");
+    }
+    events = args[1].string_val == "read" ? EPOLLIN : EPOLLOUT;
+  }
+  scheduler_wait_fd(static_cast<int>(args[0].number_val), events);
+  result_sym = make_nil();
+}
+
+Channel &channel_arg(const std::vector<LispType> &args, const char *fn_name)
+{
+  if (args.empty() || args[0].type != LispType::Type::channel) {
+    std::stringstream ss;
+    ss << fn_name << " arg0 must be channel";
+    throw std::runtime_error(ss.str());
+  }
+  return *args[0].chan_val;
+}
+
+void builtin_chan(const std::vector<LispType> &args, LispType &result_sym)
+{
+  auto chan = std::make_shared<Channel>();
+  if (args.size() > 1) {
+    throw std::runtime_error("chan requires 0 or 1 arg");
+  }
+  if (args.size() == 1) {
+    if (args[0].type != LispType::Type::number || args[0].number_val < 1) {
+      throw std::runtime_error("chan arg0 must be positive number");
+    }
+    chan->capacity = static_cast<size_t>(args[0].number_val);
+  }
+  result_sym = {
+    .type = LispType::Type::channel,
+    .chan_val = chan
+  };
+}
+
+void builtin_send(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("send requires 2 args");
+  }
+  Channel &chan = channel_arg(args, "send");
+  while (chan.buffer.size() >= chan.capacity && !chan.closed) {
+    scheduler_block(chan.senders);
+  }
+  if (chan.closed) {
+    throw std::runtime_error("send on closed channel");
+  }
+
+  chan.buffer.push_back(args[1]);
+  if (!chan.receivers.empty()) {
+    wake_task(chan.receivers.front());
+    chan.receivers.pop_front();
+  }
+  result_sym = args[1];
+}
+
+void builtin_recv(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("recv requires 1 arg");
+  }
+  Channel &chan = channel_arg(args, "recv");
+  while (chan.buffer.empty() && !chan.closed) {
+    scheduler_block(chan.receivers);
+  }
+  if (chan.buffer.empty()) {
+    result_sym = make_nil();
+    return;
+  }
+
+  result_sym = chan.buffer.front();
+  chan.buffer.pop_front();
+  if (!chan.senders.empty()) {
+    wake_task(chan.senders.front());
+    chan.senders.pop_front();
+  }
+}
+
+void builtin_close(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("close requires 1 arg");
+  }
+  Channel &chan = channel_arg(args, "close");
+  chan.closed = true;
+  g_run_queue.insert(g_run_queue.end(), chan.senders.cbegin(), chan.senders.cend());
+  g_run_queue.insert(g_run_queue.end(), chan.receivers.cbegin(), chan.receivers.cend());
+  chan.senders.clear();
+  chan.receivers.clear();
+  result_sym = make_nil();
+}
+
+// Restores the outer budget when a limited evaluation is left, charging
+// it with the fuel used inside, including by tasks spawned meanwhile.
+// Tasks that outlive the scope keep drawing from the inner budget, so
+// they never get more than what is left of it.
+struct EvalBudgetScope {
+  std::shared_ptr<EvalBudget> outer;
+  uint64_t initial_fuel;
+
+  explicit EvalBudgetScope(const EvalBudget &inner)
+    : outer(g_eval_budget_shared), initial_fuel(inner.fuel)
+  {
+    eval_budget_save();
+    eval_budget_load(std::make_shared<EvalBudget>(inner));
+  }
+
+  ~EvalBudgetScope()
+  {
+    uint64_t used = initial_fuel - g_eval_budget.fuel;
+    eval_budget_save();
+    eval_budget_load(outer);
+    g_eval_budget.fuel = g_eval_budget.fuel > used ? g_eval_budget.fuel - used : 0;
+  }
+};
+
+std::chrono::milliseconds budget_duration(symbol_number_type ms)
+{
+  if (ms >= static_cast<symbol_number_type>(EVAL_MAX_DURATION.count())) {
+    return EVAL_MAX_DURATION;
+  }
+  return std::chrono::milliseconds(static_cast<long long>(ms));
+}
+
+// nil means unlimited
+EvalBudget make_budget(const LispType &fuel, const LispType &ms, const char *fn_name)
+{
+  EvalBudget budget;
+  if (fuel.type == LispType::Type::number && fuel.number_val >= 0) {
+    if (fuel.number_val < static_cast<symbol_number_type>(std::numeric_limits<uint64_t>::max())) {
+      budget.fuel = static_cast<uint64_t>(fuel.number_val);
+    }
+  } else if (fuel.type != LispType::Type::nil) {
+    std::stringstream ss;
+    ss << fn_name << " arg0 must be positive number or nil";
+    throw std::runtime_error(ss.str());
+  }
+  if (ms.type == LispType::Type::number && ms.number_val >= 0) {
+    budget.has_deadline = true;
+    budget.deadline = std::chrono::steady_clock::now() + budget_duration(ms.number_val);
+  } else if (ms.type != LispType::Type::nil) {
+    std::stringstream ss;
+    ss << fn_name << " arg1 must be positive number of ms or nil";
+    throw std::runtime_error(ss.str());
+  }
+  return budget;
+}
+
+// (with-limits fuel ms (quote form)) evaluates form with at most fuel
+// steps and ms milliseconds, but never more than the enclosing budget.
+void builtin_with_limits(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 3) {
+    throw std::runtime_error("with-limits requires 3 args");
+  }
+  EvalBudget inner = make_budget(args[0], args[1], "with-limits");
+  inner.fuel = std::min(inner.fuel, g_eval_budget.fuel);
+  if (g_eval_budget.has_deadline
+      && (!inner.has_deadline || g_eval_budget.deadline < inner.deadline)) {
+    inner.has_deadline = true;
+    inner.deadline = g_eval_budget.deadline;
+  }
+
+  EvalBudgetScope scope(inner);
+  eval(args[2], result_sym);
+}
+
+// (set-limits fuel ms) limits every following top level evaluation
+void builtin_set_limits(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("set-limits requires 2 args");
+  }
+  g_eval_limits = make_budget(args[0], args[1], "set-limits");
+  if (g_eval_limits.has_deadline) {
+    // keep the duration, the deadline gets fixed per evaluation
+    g_eval_limits.deadline = std::chrono::steady_clock::time_point()
+      + budget_duration(args[1].number_val);
+  }
+  result_sym = make_nil();
+}
+
+// Structural equality. Walks both trees with an explicit stack and skips
+// every pair of subtrees that are the same node, which with hash-consing
+// enabled is the common case.
+bool lisp_equal(const LispType &a, const LispType &b)
+{
+  std::vector<std::pair<const LispType*, const LispType*>> pending = { { &a, &b } };
+  while (!pending.empty()) {
+    const LispType &x = *pending.back().first;
+    const LispType &y = *pending.back().second;
+    pending.pop_back();
+
+    if (x.type != y.type) {
+      return false;
+    }
+    switch (x.type) {
+    case LispType::Type::nil:
+      break;
+    case LispType::Type::number:
+      if (x.number_val != y.number_val) {
+        return false;
+      }
+      break;
+    case LispType::Type::symbol:
+    case LispType::Type::variable:
+    case LispType::Type::function:
+      if (x.string_val != y.string_val) {
+        return false;
+      }
+      break;
+    case LispType::Type::cons: {
+      const ConsCell *p = x.cons_val.get();
+      const ConsCell *q = y.cons_val.get();
+      if (p == q) {
+        break;
+      }
+      if ((p->tail == nullptr) != (q->tail == nullptr)) {
+        return false;
+      }
+      pending.push_back({ &p->head, &q->head });
+      if (p->tail != nullptr && p->tail != q->tail) {
+        pending.push_back({ &p->tail->head, &q->tail->head });
+      }
+      break;
+    }
+    case LispType::Type::sequence:
+      if (x.seq_val != y.seq_val) {
+        return false;
+      }
+      break;
+    case LispType::Type::channel:
+      if (x.chan_val != y.chan_val) {
+        return false;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+void builtin_equal(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 2) {
+    throw std::runtime_error("equal? requires 2 args");
+  }
+  result_sym = lisp_equal(args[0], args[1]) ? make_symbol("t") : make_nil();
+}
+
+// (hash-consing 't) makes the reader share equal structure, nil turns it off
+void builtin_hash_consing(const std::vector<LispType> &args, LispType &result_sym)
+{
+  if (args.size() != 1) {
+    throw std::runtime_error("hash-consing requires 1 arg");
+  }
+  g_hash_consing = args[0].type != LispType::Type::nil;
+  if (!g_hash_consing) {
+    g_hash_cons_table.clear();
+    g_hash_cons_next_sweep = HASH_CONS_SWEEP_SIZE;
+  }
+  result_sym = args[0];
+}
+
+#if defined(ENABLE_JIT) && defined(__x86_64__)
+// Small JIT for pure numeric forms like (+ x (* 2 y)). Only forms whose
+// leaves are numbers or global variables and whose functions are + - * /
+// get compiled. Everything else (and every form whose variables are not
+// numbers at call time) falls back to the interpreter.
+//
+// Generated code has the signature double(const double *consts,
+// const double *vars): rdi points at the constant pool, rsi at the
+// current values of the referenced variables, the result is in xmm0.
+
+typedef symbol_number_type (*jit_function_type)(const symbol_number_type *, const symbol_number_type *);
+
+constexpr int JIT_HOT_THRESHOLD = 2;
+constexpr size_t JIT_CACHE_SWEEP_SIZE = 1024;
+
+struct JitCode {
+  std::weak_ptr<ConsCell> form;
+  int hits = 0;
+  bool failed = false;
+
+  void *mem = nullptr;
+  size_t mem_size = 0;
+
+  std::vector<symbol_number_type> consts;
+  std::vector<const LispType*> vars;
+  std::vector<symbol_number_type> var_values;
+  // function applications the interpreter would have made, charged as fuel
+  uint64_t applications = 0;
+
+  JitCode() = default;
+  JitCode(const JitCode &other) = delete;
+  JitCode& operator=(const JitCode &other) = delete;
+
+  ~JitCode() {
+    if (mem != nullptr) {
+      munmap(mem, mem_size);
+    }
+  }
+};
+
+struct JitCompiler {
+  enum Base : uint8_t {
+    consts_base = 7, // rdi
+    vars_base = 6    // rsi
+  };
+
+  std::vector<uint8_t> code;
+  std::vector<symbol_number_type> consts;
+  std::vector<const LispType*> vars;
+  std::map<std::string, int32_t> var_slots;
+  uint64_t applications = 0;
+
+  void emit(std::initializer_list<uint8_t> bytes)
+  {
+    code.insert(code.end(), bytes);
+  }
+
+  // <opcode> xmm<reg>, qword [base + disp32]
+  void emit_mem_op(uint8_t opcode, uint8_t reg, Base base, int32_t disp)
+  {
+    emit({ 0xF2, 0x0F, opcode, static_cast<uint8_t>(0x80 | (reg << 3) | base) });
+    for (int i = 0; i < 4; ++i) {
+      code.push_back(static_cast<uint8_t>((static_cast<uint32_t>(disp) >> (i * 8)) & 0xFF));
+    }
+  }
+
+  int32_t const_slot(symbol_number_type value)
+  {
+    consts.push_back(value);
+    return static_cast<int32_t>((consts.size() - 1) * sizeof(symbol_number_type));
+  }
+
+  int32_t var_slot(const std::string &name)
+  {
+    auto it = var_slots.find(name);
+    if (it != var_slots.end()) {
+      return it->second;
+    }
+    // same as the interpreter: unknown variables get created as nil
+    vars.push_back(&g_variables[name]);
+    int32_t disp = static_cast<int32_t>((vars.size() - 1) * sizeof(symbol_number_type));
+    var_slots[name] = disp;
+    return disp;
+  }
+
+  bool leaf(const LispType &arg, Base &base, int32_t &disp)
+  {
+    if (arg.type == LispType::Type::number) {
+      base = consts_base;
+      disp = const_slot(arg.number_val);
+      return true;
+    }
+    if (arg.type == LispType::Type::variable) {
+      base = vars_base;
+      disp = var_slot(arg.string_val);
+      return true;
+    }
+    return false;
+  }
 
-void builtin_car(const std::vector<LispType> &args, LispType &result_sym)
-{
-  if (args.size() != 1) {
-    throw std::runtime_error("car requires 0 or 1 arg");
+  // loads arg into xmm0
+  bool load(const LispType &arg)
+  {
+    Base base;
+    int32_t disp;
+    if (leaf(arg, base, disp)) {
+      emit_mem_op(0x10, 0, base, disp); // movsd
+      return true;
+    }
+    return compile_form(arg);
   }
-  if (args[0].type == LispType::Type::nil) {
-    result_sym = make_nil();
-    return;
+
+  // xmm0 = xmm0 <op> arg
+  bool fold(uint8_t opcode, const LispType &arg)
+  {
+    Base base;
+    int32_t disp;
+    if (leaf(arg, base, disp)) {
+      emit_mem_op(opcode, 0, base, disp);
+      return true;
+    }
+    emit({ 0x48, 0x83, 0xEC, 0x08 });       // sub rsp, 8
+    emit({ 0xF2, 0x0F, 0x11, 0x04, 0x24 }); // movsd [rsp], xmm0
+    if (!compile_form(arg)) {
+      return false;
+    }
+    emit({ 0x66, 0x0F, 0x28, 0xC8 });       // movapd xmm1, xmm0
+    emit({ 0xF2, 0x0F, 0x10, 0x04, 0x24 }); // movsd xmm0, [rsp]
+    emit({ 0x48, 0x83, 0xC4, 0x08 });       // add rsp, 8
+    emit({ 0xF2, 0x0F, opcode, 0xC1 });     // <op>sd xmm0, xmm1
+    return true;
   }
-  if (args[0].type != LispType::Type::cons) {
-    throw std::runtime_error("car arg0 must be cons cell");
+
+  bool compile_form(const LispType &form)
+  {
+    if (form.type != LispType::Type::cons) {
+      return false;
+    }
+    const LispType &head = form.cons_val->head;
+    if (head.type != LispType::Type::function) {
+      return false;
+    }
+    ++applications;
+
+    std::vector<const LispType*> args;
+    const ConsCell *cell = form.cons_val.get();
+    while (cell->tail != nullptr && cell->tail->head.type != LispType::Type::nil) {
+      if (cell->tail->head.type != LispType::Type::cons) {
+        return false;
+      }
+      cell = cell->tail->head.cons_val.get();
+      args.push_back(&cell->head);
+    }
+
+    // mirror builtin_add & co, including their starting values so that
+    // results are bit-identical to the interpreter
+    const std::string &fn = head.string_val;
+    uint8_t opcode;
+    size_t first = 0;
+    if (fn == "+") {
+      opcode = 0x58;
+      emit_mem_op(0x10, 0, consts_base, const_slot(0.0));
+    } else if (fn == "*") {
+      opcode = 0x59;
+      emit_mem_op(0x10, 0, consts_base, const_slot(1.0));
+    } else if (fn == "-" || fn == "/") {
+      opcode = fn == "-" ? 0x5C : 0x5E;
+      if (args.empty() || !load(*args[0])) {
+        return false;
+      }
+      first = 1;
+    } else {
+      return false;
+    }
+
+    for (size_t i = first; i < args.size(); ++i) {
+      if (!fold(opcode, *args[i])) {
+        return false;
+      }
+    }
+    return true;
   }
+};
 
-  car(args[0], result_sym);
-}
+std::map<const ConsCell*, std::unique_ptr<JitCode>> g_jit_cache;
+size_t g_jit_next_sweep = JIT_CACHE_SWEEP_SIZE;
 
-void builtin_cdr(const std::vector<LispType> &args, LispType &result_sym)
+bool jit_compile(const LispType &form, JitCode &jit)
 {
-  if (args.size() != 1) {
-    throw std::runtime_error("cdr requires 1 arg");
+  JitCompiler compiler;
+  if (!compiler.compile_form(form)) {
+    return false;
   }
-  if (args[0].type == LispType::Type::nil) {
-    result_sym = make_nil();
-    return;
+  compiler.emit({ 0xC3 }); // ret
+
+  size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t size = (compiler.code.size() + page_size - 1) / page_size * page_size;
+  void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return false;
   }
-  if (args[0].type != LispType::Type::cons) {
-    throw std::runtime_error("cdr arg0 must be cons cell");
+  std::memcpy(mem, compiler.code.data(), compiler.code.size());
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    return false;
   }
 
-  cdr(args[0], result_sym);
+  jit.mem = mem;
+  jit.mem_size = size;
+  jit.consts = std::move(compiler.consts);
+  jit.vars = std::move(compiler.vars);
+  jit.var_values.resize(jit.vars.size());
+  jit.applications = compiler.applications;
+  return true;
 }
 
-void builtin_nth(const std::vector<LispType> &args, LispType &result_sym)
+void jit_sweep()
 {
-  if (args.size() != 2) {
-    throw std::runtime_error("nth requires 2 args");
+  for (auto it = g_jit_cache.begin(); it != g_jit_cache.end();) {
+    if (it->second->form.expired()) {
+      it = g_jit_cache.erase(it);
+    } else {
+      ++it;
+    }
   }
-
-  nth(args[0], args[1], result_sym);
+  g_jit_next_sweep = std::max(JIT_CACHE_SWEEP_SIZE, g_jit_cache.size() * 2);
 }
 
-void builtin_list(const std::vector<LispType> &args, LispType &result_sym)
+// must be called whenever entries of g_variables are erased, compiled
+// code holds pointers into it
+void jit_reset()
 {
-  make_list(args, result_sym);
+  g_jit_cache.clear();
+  g_jit_next_sweep = JIT_CACHE_SWEEP_SIZE;
 }
 
-void builtin_add(const std::vector<LispType> &args, LispType &result_sym)
+bool jit_try_eval(const LispType &code, LispType &result)
 {
-  symbol_number_type result = 0.0;
-  for (auto it = args.cbegin(); it != args.cend(); ++it) {
-    const LispType &s = *it;
-    if (s.type != LispType::Type::number) {
-      throw std::runtime_error("symbol not a number");
-    }
-    result += s.number_val;
+  if (code.type != LispType::Type::cons) {
+    return false;
   }
-  result_sym.type = LispType::Type::number;
-  result_sym.number_val = result;
-}
 
-void builtin_mul(const std::vector<LispType> &args, LispType &result_sym)
-{
-  symbol_number_type result = 1.0;
-  for (auto it = args.cbegin(); it != args.cend(); ++it) {
-    const LispType &s = *it;
-    if (s.type != LispType::Type::number) {
-      throw std::runtime_error("symbol not a number");
+  std::unique_ptr<JitCode> &jit = g_jit_cache[code.cons_val.get()];
+  if (jit == nullptr || jit->form.lock() != code.cons_val) {
+    // new form or a stale entry whose address got reused
+    jit = std::make_unique<JitCode>();
+    jit->form = code.cons_val;
+    if (g_jit_cache.size() > g_jit_next_sweep) {
+      jit_sweep();
+      return false;
     }
-    result *= s.number_val;
   }
-  result_sym.type = LispType::Type::number;
-  result_sym.number_val = result;
-}
-
-
-void builtin_min(const std::vector<LispType> &args, LispType &result_sym)
-{
-  if (args.size() == 0 || args[0].type != LispType::Type::number) {
-    throw std::runtime_error("invalid args");
+  if (jit->failed) {
+    return false;
   }
-  symbol_number_type result = args[0].number_val;
-  for (auto it = args.cbegin() + 1; it != args.cend(); ++it) {
-    const LispType &s = *it;
-    if (s.type != LispType::Type::number) {
-      throw std::runtime_error("symbol not a number");
+  if (jit->mem == nullptr) {
+    if (++jit->hits < JIT_HOT_THRESHOLD) {
+      return false;
+    }
+    if (!jit_compile(code, *jit)) {
+      jit->failed = true;
+      return false;
     }
-    result -= s.number_val;
   }
-  result_sym.type = LispType::Type::number;
-  result_sym.number_val = result;
-}
 
-void builtin_div(const std::vector<LispType> &args, LispType &result_sym)
-{
-  if (args.size() == 0 || args[0].type != LispType::Type::number) {
-    throw std::runtime_error("invalid args");
-  }
-  symbol_number_type result = args[0].number_val;
-  for (auto it = args.cbegin() + 1; it != args.cend(); ++it) {
-    const LispType &s = *it;
-    if (s.type != LispType::Type::number) {
-      throw std::runtime_error("symbol not a number");
+  for (size_t i = 0; i < jit->vars.size(); ++i) {
+    if (jit->vars[i]->type != LispType::Type::number) {
+      // let the interpreter produce the error
+      return false;
     }
-    result /= s.number_val;
+    jit->var_values[i] = jit->vars[i]->number_val;
   }
-  result_sym.type = LispType::Type::number;
-  result_sym.number_val = result;
+
+  eval_charge(jit->applications);
+  auto fn = reinterpret_cast<jit_function_type>(jit->mem);
+  result = make_number(fn(jit->consts.data(), jit->var_values.data()));
+  return true;
+}
+#else
+void jit_reset()
+{
 }
 
-void builtin_get(const std::vector<LispType> &args, LispType &result_sym)
+bool jit_try_eval(const LispType &code, LispType &result)
 {
-  if (args.size() != 1) {
-    throw std::runtime_error("only 1 arg allowed in eval");
-  }
-  if (args[0].type != LispType::Type::symbol) {
-    throw std::runtime_error("get: arg0 must be symbol");
-  }
-  result_sym = g_variables[args[0].string_val];
+  return false;
 }
+#endif
 
 void builtin_eval(const std::vector<LispType> &args, LispType &result_sym)
 {
   if (args.size() != 1) {
     throw std::runtime_error("only 1 arg allowed in eval");
   }
+  if (jit_try_eval(args[0], result_sym)) {
+    return;
+  }
   eval(args[0], result_sym);
 }
 
@@ -474,6 +2805,36 @@ void init_builtins()
   g_builtins["list"] = builtin_list;
   g_builtins["exit"] = builtin_exit;
   g_builtins["eval"] = builtin_eval;
+  g_builtins["<"] = builtin_less;
+  g_builtins[">"] = builtin_greater;
+  g_builtins["="] = builtin_equal_numbers;
+  g_builtins["range"] = builtin_range;
+  g_builtins["lmap"] = builtin_lmap;
+  g_builtins["lfilter"] = builtin_lfilter;
+  g_builtins["take"] = builtin_take;
+  g_builtins["drop"] = builtin_drop;
+  g_builtins["reduce"] = builtin_reduce;
+  g_builtins["collect"] = builtin_collect;
+  g_builtins["load-columns"] = builtin_load_columns;
+  g_builtins["load-binary"] = builtin_load_binary;
+  g_builtins["spawn"] = builtin_spawn;
+  g_builtins["yield"] = builtin_yield;
+  g_builtins["sleep"] = builtin_sleep;
+  g_builtins["wait-fd"] = builtin_wait_fd;
+  g_builtins["chan"] = builtin_chan;
+  g_builtins["send"] = builtin_send;
+  g_builtins["recv"] = builtin_recv;
+  g_builtins["close"] = builtin_close;
+  g_builtins["with-limits"] = builtin_with_limits;
+  g_builtins["set-limits"] = builtin_set_limits;
+  g_builtins["equal?"] = builtin_equal;
+  g_builtins["hash-consing"] = builtin_hash_consing;
+  g_builtins["length"] = builtin_length;
+  g_builtins["append"] = builtin_append;
+  g_builtins["reverse"] = builtin_reverse;
+  g_builtins["map"] = builtin_map;
+  g_builtins["filter"] = builtin_filter;
+  g_builtins["sort"] = builtin_sort;
   // quote is handled in eval directly
 }
 
@@ -494,6 +2855,14 @@ LispType parse_lisp_type_from_symbol_name(const std::string &symbol_name)
       });
   }
   
+  // no string type, "file.csv" reads as the symbol 'file.csv
+  if (symbol_name.size() >= 2 && symbol_name.front() == '"' && symbol_name.back() == '"') {
+    return LispType({
+        .type = LispType::Type::symbol,
+        .string_val = symbol_name.substr(1, symbol_name.size() - 2)
+      });
+  }
+
   bool escaped = *symbol_name.begin() == '\'';
   if (escaped) {
     return LispType({
@@ -502,17 +2871,27 @@ LispType parse_lisp_type_from_symbol_name(const std::string &symbol_name)
       });
   }
   
-  bool is_number = true;
-  for (auto it = symbol_name.begin(); it != symbol_name.end(); ++it) {
-    if (!std::isdigit(*it) && *it != '.' && *it != '-') {
-      is_number = false;
-    }
+  // a number starts with a digit, optionally after - and/or .
+  size_t digit_pos = 0;
+  if (digit_pos < symbol_name.size() && symbol_name[digit_pos] == '-') {
+    ++digit_pos;
+  }
+  if (digit_pos < symbol_name.size() && symbol_name[digit_pos] == '.') {
+    ++digit_pos;
   }
+  bool is_number = digit_pos < symbol_name.size()
+    && std::isdigit(static_cast<unsigned char>(symbol_name[digit_pos]));
 
   if (is_number) {
+    symbol_number_type number;
+    const char *end = symbol_name.data() + symbol_name.size();
+    auto res = std::from_chars(symbol_name.data(), end, number);
+    if (res.ec != std::errc() || res.ptr != end) {
+      throw std::runtime_error("invalid number: " + symbol_name);
+    }
     return LispType({
         .type = LispType::Type::number,
-        .number_val = std::stod(symbol_name)
+        .number_val = number
       });
   } else {
     return LispType({
@@ -541,6 +2920,8 @@ constexpr const char *const EVAL_KEYWORD = "eval";
 
 void eval(const LispType& code, LispType &result, std::vector<LispType> &args)
 {
+  check_task_stack();
+
   if (code.type == LispType::Type::nil) {
     result = make_nil();
     return;
@@ -600,6 +2981,7 @@ void eval(const LispType& code, LispType &result, std::vector<LispType> &args)
             resolved_vars.push_back(*it);
           }
       }
+      eval_step();
       auto func = g_builtins[head.string_val];
       func(resolved_vars, result);
     }
@@ -619,8 +3001,6 @@ void eval(const LispType& code, LispType &result)
 
 void parse(std::string sexp, LispType &root)
 {
-  std::istringstream input(sexp);
-  std::stringstream stream;
   std::string sym;
   bool got_func = false;
   
@@ -629,8 +3009,8 @@ void parse(std::string sexp, LispType &root)
   std::stack<LispType> func_stack;
   std::stack<std::vector<LispType>> args_stack;
 
-  do {
-    char token = input.get();
+  for (auto input = sexp.cbegin(); input != sexp.cend() && g_keep_running; ++input) {
+    char token = *input;
     switch (token) {
     case '(':
       got_func = false;
@@ -640,7 +3020,6 @@ void parse(std::string sexp, LispType &root)
     case ' ':
     case '\n':
     case ')':
-      sym = stream.str();
       if (sym != "") {
         if (!got_func) {
           got_func = true;
@@ -658,18 +3037,21 @@ void parse(std::string sexp, LispType &root)
           args_stack.top().push_back(parsed_type);
         }
       }
-      stream.str(std::string()); // clear
+      sym.clear();
 
       if (token == ')') {
+        if (func_stack.empty()) {
+          throw std::runtime_error("unmatching number of ()");
+        }
         LispType &func_type = func_stack.top();
         std::vector<LispType> &args = args_stack.top();
 
         LispType result = make_nil();
         for (auto it = args.crbegin(); it != args.crend(); ++it) {
-          cons(*it, result, result);
+          reader_cons(*it, result, result);
         }
 
-        cons(func_type, result, result);
+        reader_cons(func_type, result, result);
         func_stack.pop();
         args_stack.pop();
 
@@ -684,10 +3066,10 @@ void parse(std::string sexp, LispType &root)
       }
       break;
     default:
-      stream << token;
+      sym += token;
       break;
     }
-  } while (input.good() && g_keep_running);
+  }
 
   if (s_exp_cnt != 0) {
     throw  std::runtime_error("unmatching number of ()");
@@ -704,7 +3086,13 @@ void parse_and_eval(const std::string &sexp, LispType &code, LispType &result)
 
   result = make_nil();
   parse(sexp, code);
-  
+
+  EvalBudget budget = g_eval_limits;
+  if (budget.has_deadline) {
+    budget.deadline = std::chrono::steady_clock::now()
+      + (g_eval_limits.deadline - std::chrono::steady_clock::time_point());
+  }
+  EvalBudgetScope scope(budget);
   eval(code, result);
   code = make_nil();
 }
@@ -713,6 +3101,8 @@ void parse_and_eval(const std::string &sexp, LispType &code, LispType &result)
 
 int main(int argc, char **argv)
 {
+  // cin keeps its own buffer so the REPL can tell whether reading blocks
+  std::ios::sync_with_stdio(false);
   init_builtins();
   LispType code;
   LispType result;
@@ -792,7 +3182,353 @@ int main(int argc, char **argv)
   assert(result.type == LispType::Type::number);
   assert(result.number_val == 16);
 
+  // hot numeric forms go through the jit, results must match the interpreter
+  parse_and_eval("(set 'q (quote (- (+ x 0.1 (* y 3)) (/ x 4) 2.5)))", code, result);
+  parse_and_eval("(eval q)", code, result);
+  symbol_number_type interpreted = result.number_val;
+  parse_and_eval("(eval q)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == interpreted);
+
+  parse_and_eval("(set 'y -2)", code, result);
+  parse_and_eval("(eval q)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == (11 + 0.1 + (-2 * 3)) - 11.0 / 4 - 2.5);
+
+  parse_and_eval("(set 'y 'a)", code, result);
+  bool jit_fell_back = false;
+  try {
+    parse_and_eval("(eval q)", code, result);
+  } catch (std::runtime_error &e) {
+    jit_fell_back = true;
+  }
+  assert(jit_fell_back);
+
+  // lazy sequences
+  parse_and_eval("(reduce '+ (lmap (quote (* 2)) (range 0 10)))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 90);
+
+  parse_and_eval("(reduce '+ (take 3 (drop 2 (range 100))))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 9);
+
+  parse_and_eval("(reduce '+ 100 (list 1 2 3))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 106);
+
+  parse_and_eval("(set 's (collect (lfilter (quote (< 5)) (range 0 10))))", code, result);
+  parse_and_eval("(nth 0 s)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 6);
+
+  parse_and_eval("(nth 3 s)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 9);
+
+  parse_and_eval("(reduce '+ (lmap '- (take 100000 (range))))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 4999950000.0);
+
+  // column loaders
+  char csv_path[] = "/tmp/mylisp-test-XXXXXX";
+  int csv_fd = mkstemp(csv_path);
+  assert(csv_fd >= 0);
+  std::string csv = "a, b\n1,2\n3.5,-4\n";
+  ssize_t csv_written = write(csv_fd, csv.data(), csv.size());
+  assert(csv_written == static_cast<ssize_t>(csv.size()));
+  close(csv_fd);
+
+  parse_and_eval("(load-columns \"" + std::string(csv_path) + "\")", code, result);
+  unlink(csv_path);
+  parse_and_eval("(reduce '+ a)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 4.5);
+
+  parse_and_eval("(nth 1 b)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == -4);
+
+  char bin_path[] = "/tmp/mylisp-test-XXXXXX";
+  int bin_fd = mkstemp(bin_path);
+  assert(bin_fd >= 0);
+  symbol_number_type rows[] = { 1.0, 2.0, 3.0, 4.25 };
+  ssize_t bin_written = write(bin_fd, rows, sizeof(rows));
+  assert(bin_written == static_cast<ssize_t>(sizeof(rows)));
+  close(bin_fd);
+
+  parse_and_eval("(load-binary \"" + std::string(bin_path) + "\" 2)", code, result);
+  unlink(bin_path);
+  parse_and_eval("(nth 1 col1)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 4.25);
+
+  bool negative_index = false;
+  try {
+    parse_and_eval("(nth -1 col1)", code, result);
+  } catch (std::runtime_error &e) {
+    negative_index = std::string(e.what()) == "nth arg0 must be positive number";
+  }
+  assert(negative_index);
+
+  for (const char *far_index : { "(nth 3000000000 (list 1 2))", "(nth 1e300 (list 1 2))" }) {
+    parse_and_eval(far_index, code, result);
+
+    assert(result.type == LispType::Type::nil);
+  }
+
+  negative_index = false;
+  try {
+    parse_and_eval("(nth -1 (list 1 2))", code, result);
+  } catch (std::runtime_error &e) {
+    negative_index = std::string(e.what()) == "nth arg0 must be positive number";
+  }
+  assert(negative_index);
+
+  // green threads
+  parse_and_eval("(set 'c (chan 4))", code, result);
+  parse_and_eval("(spawn (quote (send c (* 3 7))))", code, result);
+  parse_and_eval("(recv c)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 21);
+
+  parse_and_eval("(spawn (quote (send c 1)))", code, result);
+  parse_and_eval("(spawn (quote (send c (+ 1 (recv c)))))", code, result);
+  parse_and_eval("(yield)", code, result);
+  parse_and_eval("(recv c)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 2);
+
+  bool deadlocked = false;
+  try {
+    parse_and_eval("(recv c)", code, result);
+  } catch (std::runtime_error &e) {
+    deadlocked = true;
+  }
+  assert(deadlocked);
+  assert(!scheduler_has_tasks());
+
+  // eval recurses once per argument, a long argument list must fit into a
+  // task and a far too long one must only fail that task. Task errors go
+  // to stdout, keep them out of the startup output.
+  for (int n : { 3000, 100000 }) {
+    std::string long_form = "(spawn (quote (send c (length (list";
+    for (int i = 0; i < n; ++i) {
+      long_form += " 1";
+    }
+    long_form += ")))))";
+    parse_and_eval(long_form, code, result);
+  }
+  std::stringstream task_output;
+  std::streambuf *stdout_buf = std::cout.rdbuf(task_output.rdbuf());
+  parse_and_eval("(recv c)", code, result);
+  LispType received = result;
+  parse_and_eval("(yield)", code, result);
+  std::cout.rdbuf(stdout_buf);
+
+  assert(received.type == LispType::Type::number);
+  assert(received.number_val == 3000);
+  assert(task_output.str().find("stack overflow in task") != std::string::npos);
+  assert(!scheduler_has_tasks());
+
+  // evaluation budgets
+  bool out_of_fuel = false;
+  try {
+    parse_and_eval("(with-limits 100 nil (quote (reduce '+ (range 1000))))", code, result);
+  } catch (EvalLimitExceeded &e) {
+    out_of_fuel = true;
+  }
+  assert(out_of_fuel);
+
+  parse_and_eval("(with-limits 100 nil (quote (reduce '+ (range 10))))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 45);
+
+  bool deadline_exceeded = false;
+  try {
+    parse_and_eval("(with-limits nil 10 (quote (reduce '+ (range))))", code, result);
+  } catch (EvalLimitExceeded &e) {
+    deadline_exceeded = true;
+  }
+  assert(deadline_exceeded);
+
+  parse_and_eval("(set-limits 50 nil)", code, result);
+  bool limited = false;
+  try {
+    parse_and_eval("(reduce '+ (range 100))", code, result);
+  } catch (EvalLimitExceeded &e) {
+    limited = true;
+  }
+  assert(limited);
+
+  // compiled forms must burn the same fuel as interpreted ones
+  parse_and_eval("(set 'x 2)", code, result);
+  parse_and_eval("(set 'q (quote (+ x (* x 3) (- x 1) (/ x 4))))", code, result);
+  for (int i = 0; i < 3; ++i) {
+    bool jit_out_of_fuel = false;
+    try {
+      parse_and_eval("(with-limits 4 nil (quote (eval q)))", code, result);
+    } catch (EvalLimitExceeded &e) {
+      jit_out_of_fuel = true;
+    }
+    assert(jit_out_of_fuel);
+  }
+  for (int i = 0; i < 3; ++i) {
+    parse_and_eval("(with-limits 5 nil (quote (eval q)))", code, result);
+
+    assert(result.type == LispType::Type::number);
+    assert(result.number_val == 9.5);
+  }
+
+  parse_and_eval("(set 'x 11)", code, result);
+  parse_and_eval("(with-limits 1e30 1e300 (quote (+ 1 2)))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 3);
+
+  parse_and_eval("(set-limits nil nil)", code, result);
+  parse_and_eval("(reduce '+ (range 100))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 4950);
+
+  // spawned tasks share the budget they were spawned under, only two of
+  // these fit into it
+  parse_and_eval("(set 'd (chan 4))", code, result);
+  parse_and_eval("(with-limits 300 nil (quote (list"
+                 " (spawn (quote (send d (reduce '+ (range 50)))))"
+                 " (spawn (quote (send d (reduce '+ (range 50)))))"
+                 " (spawn (quote (send d (reduce '+ (range 50))))))))", code, result);
+  task_output.str("");
+  stdout_buf = std::cout.rdbuf(task_output.rdbuf());
+  parse_and_eval("(yield)", code, result);
+  std::cout.rdbuf(stdout_buf);
+
+  assert(task_output.str().find("out of fuel") != std::string::npos);
+  assert(!scheduler_has_tasks());
+
+  parse_and_eval("(recv d)", code, result);
+  parse_and_eval("(recv d)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 1225);
+
+  // hash-consing
+  parse_and_eval("(set 'a (quote (g x (h 1 'b))))", code, result);
+  parse_and_eval("(set 'b (quote (k (h 1 'b))))", code, result);
+  parse_and_eval("(equal? (nth 2 a) (nth 1 b))", code, result);
+
+  assert(result.type == LispType::Type::symbol);
+
+  LispType unshared;
+  parse_and_eval("(nth 2 a)", code, unshared);
+  parse_and_eval("(nth 1 b)", code, result);
+
+  assert(result.cons_val != unshared.cons_val);
+
+  parse_and_eval("(hash-consing 't)", code, result);
+  parse_and_eval("(set 'a (quote (g x (h 1 'b))))", code, result);
+  parse_and_eval("(set 'b (quote (k (h 1 'b))))", code, result);
+  LispType shared;
+  parse_and_eval("(nth 2 a)", code, shared);
+  parse_and_eval("(nth 1 b)", code, result);
+
+  assert(result.cons_val == shared.cons_val);
+
+  parse_and_eval("(equal? a b)", code, result);
+
+  assert(result.type == LispType::Type::nil);
+
+  parse_and_eval("(hash-consing nil)", code, result);
+
+  // list library
+  parse_and_eval("(set 'l (append (list 3 1) (list 2) (list 5 4)))", code, result);
+  parse_and_eval("(length l)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 5);
+
+  parse_and_eval("(nth 4 (sort l))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 5);
+
+  parse_and_eval("(nth 0 (sort '> l))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 5);
+
+  parse_and_eval("(nth 1 (reverse (map (quote (* 10)) l)))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 50);
+
+  parse_and_eval("(reduce '+ (filter (quote (< 2)) l))", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 12);
+
+  // long lists must neither recurse while sorting nor while being freed
+  parse_and_eval("(set 'l (sort (reverse (collect (range 50000)))))", code, result);
+  parse_and_eval("(nth 49999 l)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 49999);
+
+  parse_and_eval("(set 'l nil)", code, result);
+
+  parse_and_eval("(set 'l (reduce 'list (range 60000)))", code, result);
+  parse_and_eval("(length l)", code, result);
+
+  assert(result.type == LispType::Type::number);
+  assert(result.number_val == 2);
+
+  parse_and_eval("(set 'l nil)", code, result);
+
+  // printer and number reader
+  parse_and_eval("(list 1 (list 2 (list 3 'a) x) (/ 1 3) 1e+300)", code, result);
+  std::stringstream printed;
+  print_lisp_type(result, true, printed);
+
+  assert(printed.str() == "[c] (1 (2 (3 'a) 11) 0.3333333333333333 1e+300)");
+
+  parse_and_eval("(/ 2 3)", code, result);
+  std::string number_text;
+  append_lisp_type(result, false, number_text);
+  LispType reread = parse_lisp_type_from_symbol_name(number_text);
+
+  assert(reread.type == LispType::Type::number);
+  assert(reread.number_val == result.number_val);
+
+  parse_and_eval("(+ 0.1 0.2)", code, result);
+  number_text.clear();
+  append_lisp_type(result, false, number_text);
+
+  assert(number_text == "0.30000000000000004");
+
+  parse_and_eval("(* 4 100000)", code, result);
+  number_text.clear();
+  append_lisp_type(result, false, number_text);
+
+  assert(number_text == "400000");
+  assert(parse_lisp_type_from_symbol_name("-").type == LispType::Type::variable);
+
   g_variables.clear();
+  jit_reset();
   
   std::cout << "ALL STARTUP TESTS PASSED!\n\n";
 #endif
@@ -811,8 +3547,12 @@ int main(int argc, char **argv)
     std::cout << ">> ";
     std::cout.flush();
     std::string sexp;
-    std::getline(std::cin, sexp);
     try {
+      // let spawned tasks run while waiting for input
+      if (scheduler_has_tasks() && std::cin.rdbuf()->in_avail() <= 0) {
+        scheduler_wait_fd(STDIN_FILENO, EPOLLIN);
+      }
+      std::getline(std::cin, sexp);
       parse_and_eval(sexp, code, result);
       print_lisp_type(result, true);
       std::cout << "\n";